@@ -9,7 +9,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include "clock.h"
 
 
@@ -133,6 +137,25 @@ double get_counter()
     return result;
 }
 
+#elif defined(__x86_64__)
+
+/*******************************************************
+ * x86-64 versions of start_counter() and get_counter(),
+ * built on the fenced time stamp counter reads below
+ *******************************************************/
+
+static unsigned long long cyc_start = 0;
+
+void start_counter()
+{
+    cyc_start = tsc_begin();
+}
+
+double get_counter()
+{
+    return (double) (tsc_end() - cyc_start);
+}
+
 #else
 
 /****************************************************************
@@ -163,6 +186,96 @@ double get_counter()
 
 
 
+/*******************************************************
+ * Time stamp counter reads for the tsc timing backend
+ *******************************************************/
+
+#if defined(__x86_64__)
+
+/* 
+ * tsc_usable - The TSC can time a function only if it ticks at a
+ * constant rate in every power state (invariant TSC, CPUID
+ * 0x80000007 EDX bit 8) and rdtscp exists (CPUID 0x80000001 EDX bit 27)
+ */
+int tsc_usable()
+{
+    unsigned a, b, c, d;
+
+    if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+	return 0;
+    if (!__get_cpuid(0x80000001, &a, &b, &c, &d) || !(d & (1u << 27)))
+	return 0;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1u << 8)))
+	return 0;
+    return 1;
+}
+
+/* Read the TSC once all earlier instructions have completed, and
+   before any later one starts */
+unsigned long long tsc_begin()
+{
+    unsigned hi, lo;
+
+    asm volatile("lfence; rdtsc; lfence" : "=a" (lo), "=d" (hi) : : "memory");
+    return ((unsigned long long) hi << 32) | lo;
+}
+
+/* rdtscp waits for the code being timed; the lfence keeps what
+   follows from starting before the read */
+unsigned long long tsc_end()
+{
+    unsigned hi, lo, aux;
+
+    asm volatile("rdtscp; lfence" : "=a" (lo), "=d" (hi), "=c" (aux) : : "memory");
+    return ((unsigned long long) hi << 32) | lo;
+}
+
+#else
+
+int tsc_usable()
+{
+    return 0;
+}
+
+unsigned long long tsc_begin()
+{
+    return 0;
+}
+
+unsigned long long tsc_end()
+{
+    return 0;
+}
+
+#endif
+
+/* Nanoseconds on the clock that NTP does not slew */
+double raw_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* 
+ * tsc_hz - TSC ticks per second, counted against CLOCK_MONOTONIC_RAW
+ * over a busy-waited window of msecs milliseconds
+ */
+double tsc_hz(int msecs)
+{
+    double t0, t1;
+    unsigned long long c0, c1;
+
+    t0 = raw_ns();
+    c0 = tsc_begin();
+    do
+	t1 = raw_ns();
+    while (t1 - t0 < msecs * 1e6);
+    c1 = tsc_end();
+    return (c1 - c0) / ((t1 - t0) * 1e-9);
+}
+
 /*******************************
  * Machine-independent functions
  ******************************/
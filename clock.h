@@ -20,3 +20,18 @@ double mhz_full(int verbose, int sleeptime);
 void start_comp_counter();
 
 double get_comp_counter();
+
+/** Time stamp counter routines for the tsc timing backend */
+
+/* Whether the TSC is invariant and rdtscp exists (x86-64 only) */
+int tsc_usable();
+
+/* Fenced TSC reads to put before and after the code being timed */
+unsigned long long tsc_begin();
+unsigned long long tsc_end();
+
+/* TSC ticks per second, calibrated over msecs milliseconds */
+double tsc_hz(int msecs);
+
+/* Nanoseconds on CLOCK_MONOTONIC_RAW */
+double raw_ns();
@@ -30,7 +30,8 @@
   "random-bal.rep",\
   "random2-bal.rep",\
   "binary-bal.rep",\
-  "binary2-bal.rep"
+  "binary2-bal.rep",\
+  "realloc2-bal.rep"
 
 /*
  * This constant gives the estimated performance of the libc malloc
@@ -61,6 +62,14 @@
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_TSC    1   /* rdtscp or CLOCK_MONOTONIC_RAW, median of many runs */
+
+/*
+ * With USE_TSC, each trace is timed at least TSC_MIN_RUNS times and
+ * until TSC_MIN_SECS seconds have been spent timing it.
+ */
+#define TSC_MIN_RUNS 11
+#define TSC_MIN_SECS 0.05
 
 #endif /* __CONFIG_H */
@@ -9,6 +9,7 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static double last_lo, last_hi; /* interval around the last measurement */
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -36,6 +37,14 @@ void init_fsecs(void)
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_TSC
+    if (ftimer_tsc_hz() > 0) {
+	if (verbose)
+	    printf("Measuring performance with rdtscp (invariant TSC at %.3f GHz).\n",
+		   ftimer_tsc_hz() / 1e9);
+    }
+    else if (verbose)
+	printf("Measuring performance with CLOCK_MONOTONIC_RAW.\n");
 #endif
 }
 
@@ -44,14 +53,33 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
+#if USE_TSC
+    return ftimer_tsc(f, argp, TSC_MIN_RUNS, TSC_MIN_SECS, &last_lo, &last_hi);
+#else
+    double secs;
+
 #if USE_FCYC
     double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
+    secs = cycles/(Mhz*1e6);
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    secs = ftimer_itimer(f, argp, 10);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    secs = ftimer_gettod(f, argp, 10);
 #endif 
+    last_lo = last_hi = secs;
+    return secs;
+#endif
+}
+
+/*
+ * fsecs_interval - The 95% confidence interval around the time the
+ *     last fsecs call returned, or just that time if the timing
+ *     method has none
+ */
+void fsecs_interval(double *lo, double *hi)
+{
+    *lo = last_lo;
+    *hi = last_hi;
 }
 
 
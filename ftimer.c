@@ -7,10 +7,18 @@
  * Function timers that estimate the running time (in seconds) of a function f.
  *    ftimer_itimer: version that uses the interval timer
  *    ftimer_gettod: version that uses gettimeofday
+ *    ftimer_tsc: version that uses rdtscp or CLOCK_MONOTONIC_RAW and
+ *                reports the median of many runs
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include <sys/time.h>
 #include "ftimer.h"
+#include "clock.h"
+
+/* Most runs ftimer_tsc keeps samples of */
+#define FTIMER_MAX_RUNS 1001
 
 /* function prototypes */
 static void init_etime(void);
@@ -52,6 +60,66 @@ double ftimer_gettod(ftimer_test_funct f, void *argp, int n)
     return (1E-3*diff);
 }
 
+/* TSC ticks per second, 0 without a usable TSC, -1 until measured */
+static double tsc_ticks = -1;
+
+/* Whether ftimer_tsc reads the TSC rather than CLOCK_MONOTONIC_RAW
+   (nonzero), and at how many ticks per second */
+double ftimer_tsc_hz(void)
+{
+    if (tsc_ticks < 0)
+	tsc_ticks = tsc_usable() ? tsc_hz(50) : 0;
+    return tsc_ticks;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* 
+ * ftimer_tsc - Time f(argp) with the TSC when it is invariant, else
+ * with CLOCK_MONOTONIC_RAW. After one warm-up run, f runs at least
+ * min_runs times and until min_secs have been spent in it (but no
+ * more than FTIMER_MAX_RUNS times). Return the median run time, and
+ * set *lo and *hi to a 95% confidence interval for the median, from
+ * the order statistics at ranks n/2 -+ 0.98 sqrt(n).
+ */
+double ftimer_tsc(ftimer_test_funct f, void *argp, int min_runs, double min_secs,
+		  double *lo, double *hi)
+{
+    static double samples[FTIMER_MAX_RUNS];
+    double hz = ftimer_tsc_hz();
+    double total = 0, t0, t1, median;
+    unsigned long long c0, c1;
+    int n, j, k;
+
+    f(argp);
+    for (n = 0; n < FTIMER_MAX_RUNS && (n < min_runs || total < min_secs); n++) {
+	if (hz > 0) {
+	    c0 = tsc_begin();
+	    f(argp);
+	    c1 = tsc_end();
+	    samples[n] = (c1 - c0) / hz;
+	}
+	else {
+	    t0 = raw_ns();
+	    f(argp);
+	    t1 = raw_ns();
+	    samples[n] = (t1 - t0) * 1e-9;
+	}
+	total += samples[n];
+    }
+
+    qsort(samples, n, sizeof(double), cmp_double);
+    median = (n % 2) ? samples[n/2] : (samples[n/2 - 1] + samples[n/2]) / 2;
+    j = (int)floor(n / 2.0 - 0.98 * sqrt(n));
+    k = (int)ceil(n / 2.0 + 0.98 * sqrt(n));
+    *lo = samples[j < 0 ? 0 : j];
+    *hi = samples[k > n - 1 ? n - 1 : k];
+    return median;
+}
 
 /*
  * Routines for manipulating the Unix interval timer
@@ -12,3 +12,13 @@ double ftimer_itimer(ftimer_test_funct f, void *argp, int n);
    Return the average of n runs */
 double ftimer_gettod(ftimer_test_funct f, void *argp, int n);
 
+/* Estimate the running time of f(argp) using rdtscp, or
+   CLOCK_MONOTONIC_RAW without an invariant TSC. Return the median of
+   at least min_runs runs that take at least min_secs in all, with a
+   95% confidence interval for it in *lo and *hi */
+double ftimer_tsc(ftimer_test_funct f, void *argp, int min_runs, double min_secs,
+		  double *lo, double *hi);
+
+/* TSC ticks per second that ftimer_tsc uses, or 0 if it uses
+   CLOCK_MONOTONIC_RAW */
+double ftimer_tsc_hz(void);
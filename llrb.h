@@ -0,0 +1,169 @@
+/*
+ * llrb.h - An intrusive left-leaning red-black tree, the one behind
+ *     mdriver's range tree, memlib's extents and mm.c's free tree
+ *
+ * A node of the tree is any struct whose first member is an llrb_node,
+ * so that a pointer to one is a pointer to the other. The tree orders
+ * its nodes by a compare function, which returns a negative number when
+ * a sorts before b; no two nodes may compare equal. The tree never
+ * allocates: its users keep the nodes where they like, and walk the
+ * left and right links themselves to search for a key.
+ */
+#ifndef LLRB_H
+#define LLRB_H
+
+#include <stddef.h>
+
+typedef struct llrb_node {
+    struct llrb_node *left;   /* nodes that sort before this one */
+    struct llrb_node *right;  /* nodes that sort after it */
+    size_t red;               /* color of the link from the parent */
+} llrb_node;
+
+typedef int (*llrb_cmp_t)(const llrb_node *a, const llrb_node *b);
+
+static inline int llrb_is_red(llrb_node *h)
+{
+    return h != NULL && h->red;
+}
+
+static inline llrb_node *llrb_rotate_left(llrb_node *h)
+{
+    llrb_node *x = h->right;
+
+    h->right = x->left;
+    x->left = h;
+    x->red = h->red;
+    h->red = 1;
+    return x;
+}
+
+static inline llrb_node *llrb_rotate_right(llrb_node *h)
+{
+    llrb_node *x = h->left;
+
+    h->left = x->right;
+    x->right = h;
+    x->red = h->red;
+    h->red = 1;
+    return x;
+}
+
+static inline void llrb_flip_colors(llrb_node *h)
+{
+    h->red = !h->red;
+    h->left->red = !h->left->red;
+    h->right->red = !h->right->red;
+}
+
+/* llrb_fixup - restore the left-leaning shape on the way back up */
+static inline llrb_node *llrb_fixup(llrb_node *h)
+{
+    if (llrb_is_red(h->right) && !llrb_is_red(h->left))
+	h = llrb_rotate_left(h);
+    if (llrb_is_red(h->left) && llrb_is_red(h->left->left))
+	h = llrb_rotate_right(h);
+    if (llrb_is_red(h->left) && llrb_is_red(h->right))
+	llrb_flip_colors(h);
+    return h;
+}
+
+static inline llrb_node *llrb_move_red_left(llrb_node *h)
+{
+    llrb_flip_colors(h);
+    if (llrb_is_red(h->right->left)) {
+	h->right = llrb_rotate_right(h->right);
+	h = llrb_rotate_left(h);
+	llrb_flip_colors(h);
+    }
+    return h;
+}
+
+static inline llrb_node *llrb_move_red_right(llrb_node *h)
+{
+    llrb_flip_colors(h);
+    if (llrb_is_red(h->left->left)) {
+	h = llrb_rotate_right(h);
+	llrb_flip_colors(h);
+    }
+    return h;
+}
+
+static inline llrb_node *llrb_insert_at(llrb_node *h, llrb_node *n,
+					llrb_cmp_t cmp)
+{
+    if (h == NULL)
+	return n;
+    if (cmp(n, h) < 0)
+	h->left = llrb_insert_at(h->left, n, cmp);
+    else
+	h->right = llrb_insert_at(h->right, n, cmp);
+    return llrb_fixup(h);
+}
+
+static inline llrb_node *llrb_delete_min(llrb_node *h, llrb_node **min)
+{
+    if (h->left == NULL) {
+	*min = h;
+	return NULL;
+    }
+    if (!llrb_is_red(h->left) && !llrb_is_red(h->left->left))
+	h = llrb_move_red_left(h);
+    h->left = llrb_delete_min(h->left, min);
+    return llrb_fixup(h);
+}
+
+/* llrb_delete_at - unlink n, which must be in the tree below h */
+static inline llrb_node *llrb_delete_at(llrb_node *h, llrb_node *n,
+					llrb_cmp_t cmp)
+{
+    llrb_node *min;
+
+    if (cmp(n, h) < 0) {
+	if (!llrb_is_red(h->left) && !llrb_is_red(h->left->left))
+	    h = llrb_move_red_left(h);
+	h->left = llrb_delete_at(h->left, n, cmp);
+    }
+    else {
+	if (llrb_is_red(h->left))
+	    h = llrb_rotate_right(h);
+	if (h == n && h->right == NULL)
+	    return NULL;
+	if (!llrb_is_red(h->right) && !llrb_is_red(h->right->left))
+	    h = llrb_move_red_right(h);
+	if (h == n) {
+	    /* Put n's successor in its place */
+	    h->right = llrb_delete_min(h->right, &min);
+	    min->left = h->left;
+	    min->right = h->right;
+	    min->red = h->red;
+	    h = min;
+	}
+	else
+	    h->right = llrb_delete_at(h->right, n, cmp);
+    }
+    return llrb_fixup(h);
+}
+
+/*
+ * llrb_insert, llrb_remove - add node n to, or take it out of, the tree
+ *     rooted at *root
+ */
+static inline void llrb_insert(llrb_node **root, llrb_node *n, llrb_cmp_t cmp)
+{
+    n->left = n->right = NULL;
+    n->red = 1;
+    *root = llrb_insert_at(*root, n, cmp);
+    (*root)->red = 0;
+}
+
+static inline void llrb_remove(llrb_node **root, llrb_node *n, llrb_cmp_t cmp)
+{
+    if (!llrb_is_red((*root)->left) && !llrb_is_red((*root)->right))
+	(*root)->red = 1;
+    *root = llrb_delete_at(*root, n, cmp);
+    if (*root != NULL)
+	(*root)->red = 0;
+}
+
+#endif
@@ -17,10 +17,22 @@
 #include <math.h>
 #include <inttypes.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <linux/perf_event.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "pagemap.h"
+#include "trace.h"
+#include "llrb.h"
 #include "fsecs.h"
 #include "config.h"
 
@@ -40,19 +52,25 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The records form a
+ * left-leaning red-black tree ordered by lo.
+ */
 typedef struct range_t {
+    llrb_node link;        /* first, so an llrb_node is a range_t; its
+			      right link chains the free pool */
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+#define RANGE(h) ((range_t *)(h))
+
+/* Range records are carved from pool blocks of this many records */
+#define RANGE_POOL_BLOCK 4096
+
+/* The util run counts resident pages after every RESIDENT_EVERY ops,
+   and after the last, since each count asks mincore about the heap */
+#define RESIDENT_EVERY 16
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -63,6 +81,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace file, or NULL */
+    size_t map_len;      /* length of that mapping */
 } trace_t;
 
 /* 
@@ -72,21 +92,72 @@ typedef struct {
  */
 typedef struct {
     trace_t *trace;  
-    range_t *ranges;
+    llrb_node *ranges;
 } speed_t;
 
+/* 
+ * Latency histograms are log-linear: values below LAT_SUB nanoseconds
+ * get a bucket each, and every power of two above that is split into
+ * LAT_SUB equal buckets, for a relative error of at most 1/LAT_SUB.
+ */
+#define LAT_SUB_BITS 3
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_SIZES    8  /* request size classes: <=64, <=256, ... >256K */
+#define LAT_OPS      3  /* indexed by the traceop_t type */
+
+typedef struct {
+    unsigned long count;              /* number of recorded ops */
+    unsigned long long max;           /* slowest op, in nanoseconds */
+    unsigned long bucket[LAT_BUCKETS];
+} lat_hist_t;
+
+/* Threaded replay (-T): thread counts 1, 2, 4, ... and the one asked for */
+#define MAX_THREADS  256
+#define MAX_SCALE    10  /* thread counts in the scaling curve */
+#define THREAD_RUNS  5   /* replays per thread count; the fastest counts */
+
+/* Hardware events counted over extra replays (-P, and dTLB misses with -H) */
+#define PERF_EVENTS  6
+#define PERF_RUNS    5   /* replays counted per trace */
+enum { PERF_CYCLES, PERF_INSNS, PERF_L1D, PERF_LLC, PERF_DTLB, PERF_BRANCH };
+
+/* One thread's share of a threaded replay */
+typedef struct {
+    trace_t *trace;
+    int *ops;            /* indices of this thread's requests, in trace order */
+    int num_ops;         /* number of those requests */
+    const int *seq;      /* with -X, each request's place among its id's */
+    int *done;           /* with -X, requests done so far on each id */
+    unsigned long long start, end; /* when this thread began and finished */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double secs_lo, secs_hi; /* 95% confidence interval around secs */
 
     /* defined only for the student malloc package */
     double util;     /* overall space utilization for this trace (always 0 for libc) */
 
     double inst_util;     /* instanteous space utilization for this trace (always 0 for libc) */
 
+    double maps;     /* mem_map calls during the util run */
+    double unmaps;   /* mem_unmap calls during the util run */
+    double reused;   /* retained chunks reused, each saving a map and an unmap */
+    double purges;   /* mem_purge calls during the util run */
+    double heap;     /* mean mem_heapsize over the ops of the util run */
+    double resident; /* mean mem_resident over sampled ops of the util run */
+
+    lat_hist_t lat;  /* per-op latencies, only filled in with -L */
+
+    double tsecs[MAX_SCALE]; /* wall time of the threaded replays (-T) */
+
+    double perf[PERF_EVENTS]; /* events per op (-P, -H); < 0 if unknown */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
@@ -105,19 +176,61 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* Per-op latency measurement (-L) */
+static int latency = 0;
+static unsigned long long lat_overhead; /* cost of one pair of timer reads */
+static lat_hist_t mm_lat_by_op[LAT_OPS][LAT_SIZES];
+static lat_hist_t libc_lat_by_op[LAT_OPS][LAT_SIZES];
+
+/* Threaded replay (-T) */
+static int threads = 0;                 /* the most threads to replay with */
+static int scale[MAX_SCALE];            /* the thread counts to replay with */
+static int num_scale = 0;
+static int cross_frees = 0;             /* free each block on the next thread */
+static double thread_ops[MAX_THREADS];  /* per-thread totals at the most */
+static double thread_secs[MAX_THREADS]; /*   threads, over all traces */
+static pthread_barrier_t replay_barrier;
+
+/* Parallel evaluation of the mm traces (-j) */
+static int jobs = 1;                    /* worker processes to run at once */
+
+/* What a worker sends back about its trace, in memory shared with main */
+typedef struct {
+    stats_t stats;
+    int errors;                         /* malloc_error calls */
+    int status;                         /* from waitpid */
+    size_t map_bytes;                   /* the worker's page map metadata */
+    FILE *out;                          /* the worker's stdout */
+    double thread_ops[MAX_THREADS];
+    double thread_secs[MAX_THREADS];
+    lat_hist_t lat_by_op[LAT_OPS][LAT_SIZES];
+} job_t;
+
+/* Huge page mode (-H) */
+static int huge = 0;
+
+/* Hardware event counters (-P), one perf_event_open group */
+static int perf_want = 0;               /* bit e: count event e */
+static int perf_fd[PERF_EVENTS];        /* counter of event e, or -1 */
+static int perf_leader = -1;            /* first counter opened, or -1 */
+static const char *perf_names[PERF_EVENTS] = {
+    "cyc/op", "ins/op", "L1D/op", "LLC/op", "dTLB/op", "br/op"
+};
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range trees */
+static int add_range(llrb_node **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(llrb_node **ranges, char *lo);
+static void clear_ranges(llrb_node **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename, int fn_index);
+static void write_bintrace(trace_t *trace, char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -126,9 +239,29 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges, int checks, int chaos);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio);
+static int eval_mm_valid(trace_t *trace, int tracenum, llrb_node **ranges, int checks, int chaos);
+static double eval_mm_util(trace_t *trace, int tracenum, llrb_node **ranges, double *inst_ratio,
+                           stats_t *map_stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats,
+			  int checks, int repeats);
+static size_t eval_mm_jobs(char **tracefiles, int n, stats_t *stats,
+			   int checks, int repeats);
+
+/* Routines for replaying a trace on several threads at once */
+static inline unsigned long long lat_now(void);
+static void eval_mm_threads(trace_t *trace, int tracenum, stats_t *stats,
+			    int checks);
+static void *replay_thread(void *ptr);
+
+/* Routines for recording the latency of each request of either package */
+static void eval_latency(trace_t *trace, int use_mm, lat_hist_t *all,
+			 lat_hist_t by_op[LAT_OPS][LAT_SIZES]);
+static void lat_merge(lat_hist_t *dst, lat_hist_t *src);
+
+/* Routines for counting hardware events in replays of either package */
+static void perf_open(int report);
+static void eval_perf(void (*f)(void *), speed_t *params, double *perf);
 
 /* Various helper routines */
 static int check(int chaos, const char *what);
@@ -136,6 +269,12 @@ static int check_free(int chaos, void *p);
 static void check_post_free(int chaos, void *p);
 static void mangle(void);
 static void printresults(int n, stats_t *stats);
+static void printlatency(lat_hist_t *h);
+static void printperf(double *perf);
+static void printinterval(double secs, double lo, double hi);
+static void printmapresults(int n, stats_t *stats, size_t map_bytes);
+static void printlatresults(lat_hist_t by_op[LAT_OPS][LAT_SIZES]);
+static void printthreadresults(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -146,13 +285,11 @@ static void app_error(char *msg);
  **************/
 int main(int argc, char **argv)
 {
-  int i, j;
+  int i;
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
-    range_t *d_ranges = NULL;  
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
@@ -161,6 +298,8 @@ int main(int argc, char **argv)
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
     int checks = 1;      /* Whether to use mm_check and mm_can_free */
     int repeats = 1;     /* Number of times to try random chaos */
+    int convert = 0;     /* If set, only convert the traces to binary (-c) */
+    size_t map_bytes;    /* page map metadata, the most of any process */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, inst_util, avg_mm_inst_util, avg_mm_util, avg_mm_throughput;
@@ -172,7 +311,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "s:r:f:t:hqgaln")) != EOF) {
+    while ((c = getopt(argc, argv, "s:r:f:t:T:j:hqgalncLHPX")) != EOF) {
         switch (c) {
         case 's':
             srandom(atoi(optarg));
@@ -183,6 +322,36 @@ int main(int argc, char **argv)
         case 'n':
             checks = 0;
             break;
+        case 'c': /* Convert the traces to binary and exit */
+            convert = 1;
+            break;
+        case 'L': /* Measure the latency of each request */
+            latency = 1;
+            break;
+        case 'H': /* Map huge pages and count dTLB misses */
+            huge = 1;
+            perf_want |= 1 << PERF_DTLB;
+            break;
+        case 'P': /* Count hardware events per request */
+            perf_want = (1 << PERF_EVENTS) - 1;
+            break;
+        case 'T': /* Also replay the traces on up to this many threads */
+            threads = atoi(optarg);
+            if (threads < 1 || threads > MAX_THREADS) {
+                fprintf(stderr, "-T needs 1 to %d threads\n", MAX_THREADS);
+                exit(1);
+            }
+            break;
+        case 'X': /* Free blocks on a thread other than their allocator's */
+            cross_frees = 1;
+            break;
+        case 'j': /* Evaluate this many mm traces at once */
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "-j needs at least 1 job\n");
+                exit(1);
+            }
+            break;
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
@@ -226,8 +395,28 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* 
+     * Optionally write each trace next to its source as a binary trace
+     */
+    if (convert) {
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i], i);
+	    write_bintrace(trace, tracedir, tracefiles[i]);
+	    free_trace(trace);
+	}
+	exit(0);
+    }
+
+    /* Replay with 1, 2, 4, ... threads, ending with the number asked for */
+    for (i = 1; threads > 0 && i < threads && num_scale < MAX_SCALE - 1; i *= 2)
+	scale[num_scale++] = i;
+    if (threads > 0)
+	scale[num_scale++] = threads;
+
     /* Initialize the timing package */
     init_fsecs();
+    if (perf_want)
+	perf_open(1);
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -253,6 +442,11 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		fsecs_interval(&libc_stats[i].secs_lo, &libc_stats[i].secs_hi);
+		if (perf_want)
+		    eval_perf(eval_libc_speed, &speed_params, libc_stats[i].perf);
+		if (latency)
+		    eval_latency(trace, 0, &libc_stats[i].lat, libc_lat_by_op);
 	    }
 	    free_trace(trace);
 	}
@@ -261,6 +455,10 @@ int main(int argc, char **argv)
 	if (verbose) {
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
+	    if (latency) {
+		printf("\nLatency by request for libc malloc (ns):\n");
+		printlatresults(libc_lat_by_op);
+	    }
 	}
     }
 
@@ -277,46 +475,31 @@ int main(int argc, char **argv)
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
+    mem_set_hugepages(huge);
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-        trace = read_trace(tracedir, tracefiles[i], i);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1) {
-          printf("Checking mm_malloc for correctness, ");
-          fflush(stdout);
-        }
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges, checks, 0);
-	if (mm_stats[i].valid) {
-          if (checks && (repeats > 0)) {
-            if (verbose > 1) {
-              printf("defensiveness, ");
-              fflush(stdout);
-            }
-            for (j = 0; j < repeats; j++)
-              (void)eval_mm_valid(trace, i, &d_ranges, checks, 1);
-          }
-          
-          if (verbose > 1) {
-            printf("efficiency, ");
-            fflush(stdout);
-          }
-          mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i].inst_util);
-          speed_params.trace = trace;
-          speed_params.ranges = ranges;
-          if (verbose > 1) {
-            printf("and performance.\n");
-            fflush(stdout);
-          }
-          mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+    if (jobs > 1)
+	map_bytes = eval_mm_jobs(tracefiles, num_tracefiles, mm_stats, checks, repeats);
+    else {
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, &mm_stats[i], checks, repeats);
+	map_bytes = pagemap_bytes();
     }
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
+	printf("\nChunk mapping for mm malloc:\n");
+	printmapresults(num_tracefiles, mm_stats, map_bytes);
+	if (latency) {
+	    printf("\nLatency by request for mm malloc (ns):\n");
+	    printlatresults(mm_lat_by_op);
+	}
+	if (threads) {
+	    printf("\nThreaded replay for mm malloc (Kops):\n");
+	    printthreadresults(num_tracefiles, mm_stats);
+	}
 	printf("\n");
     }
 
@@ -378,18 +561,69 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Since the
+ * payloads in the tree never overlap, a new payload overlaps one iff
+ * it overlaps the payload with the greatest lo not above its hi.
  ****************************************************************/
 
+/* Free range records, linked through their right pointers */
+static range_t *range_pool = NULL;
+
+static range_t *range_alloc(void)
+{
+    range_t *p;
+    int i;
+
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGE_POOL_BLOCK * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in range_alloc");
+	for (i = 0; i < RANGE_POOL_BLOCK; i++) {
+	    p[i].link.right = (llrb_node *)range_pool;
+	    range_pool = &p[i];
+	}
+    }
+
+    p = range_pool;
+    range_pool = RANGE(p->link.right);
+    return p;
+}
+
+static void range_release(range_t *p)
+{
+    p->link.right = (llrb_node *)range_pool;
+    range_pool = p;
+}
+
+static int range_cmp(const llrb_node *a, const llrb_node *b)
+{
+    return RANGE(a)->lo < RANGE(b)->lo ? -1 : RANGE(a)->lo > RANGE(b)->lo;
+}
+
+/* range_floor - the range with the greatest lo that is <= addr, if any */
+static range_t *range_floor(llrb_node *h, char *addr)
+{
+    range_t *best = NULL;
+
+    while (h != NULL) {
+	if (RANGE(h)->lo <= addr) {
+	    best = RANGE(h);
+	    h = h->right;
+	}
+	else
+	    h = h->left;
+    }
+    return best;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(llrb_node **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
@@ -424,59 +658,51 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    p = range_floor(*ranges, hi);
+    if (p != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = range_alloc();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    llrb_insert(ranges, &p->link, range_cmp);
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(llrb_node **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t *p = range_floor(*ranges, lo);
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    if (p == NULL || p->lo != lo)
+	return;
+
+    llrb_remove(ranges, &p->link, range_cmp);
+    range_release(p);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(llrb_node **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    llrb_node *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    range_release(RANGE(p));
     *ranges = NULL;
 }
 
@@ -486,12 +712,95 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * check_bintrace - make sure that every op of a mapped binary trace can
+ *     be replayed: a known type, an index below num_ids, a size that is
+ *     not negative, and an id that is allocated exactly when the op
+ *     expects it to be
+ */
+static void check_bintrace(trace_t *trace, char *path)
+{
+    char *live;
+    traceop_t *op;
+    int i;
+
+    if ((live = calloc(trace->num_ids > 0 ? trace->num_ids : 1, 1)) == NULL)
+	unix_error("calloc failed in check_bintrace");
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if (op->index < 0 || op->index >= trace->num_ids)
+	    sprintf(msg, "Binary trace %s: op %d has index %d, expected 0 to %d",
+		    path, i, op->index, trace->num_ids - 1);
+	else if (op->type != FREE && op->size < 0)
+	    sprintf(msg, "Binary trace %s: op %d has size %d", 
+		    path, i, op->size);
+	else if (op->type == ALLOC && live[op->index])
+	    sprintf(msg, "Binary trace %s: op %d allocates live id %d",
+		    path, i, op->index);
+	else if ((op->type == FREE || op->type == REALLOC) && !live[op->index])
+	    sprintf(msg, "Binary trace %s: op %d uses free id %d",
+		    path, i, op->index);
+	else if (op->type != ALLOC && op->type != FREE && op->type != REALLOC)
+	    sprintf(msg, "Binary trace %s: op %d has bogus type %d",
+		    path, i, (int)op->type);
+	else {
+	    live[op->index] = op->type != FREE;
+	    continue;
+	}
+	app_error(msg);
+    }
+    free(live);
+}
+
+/*
+ * map_bintrace - map a binary trace file opened as fd, whose header
+ *     has already been read into hdr, check it and use its ops in place
+ */
+static void map_bintrace(trace_t *trace, int fd, bintrace_hdr_t *hdr, 
+			 char *path)
+{
+    struct stat st;
+
+    if (hdr->op_size != sizeof(traceop_t)) {
+	sprintf(msg, "Binary trace %s has %d-byte ops, expected %d", 
+		path, hdr->op_size, (int)sizeof(traceop_t));
+	app_error(msg);
+    }
+    if (hdr->num_ids < 0 || hdr->num_ops < 0) {
+	sprintf(msg, "Binary trace %s has %d ids and %d ops", 
+		path, hdr->num_ids, hdr->num_ops);
+	app_error(msg);
+    }
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in read_trace");
+    trace->map_len = sizeof(bintrace_hdr_t) + 
+	(size_t)hdr->num_ops * sizeof(traceop_t);
+    if ((size_t)st.st_size < trace->map_len) {
+	sprintf(msg, "Binary trace %s is truncated", path);
+	app_error(msg);
+    }
+
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+	unix_error("mmap failed in read_trace");
+    madvise(trace->map, trace->map_len, MADV_WILLNEED);
+
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)((char *)trace->map + sizeof(bintrace_hdr_t));
+    check_bintrace(trace, path);
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace (see write_bintrace) is mapped instead of parsed.
  */
 static trace_t *read_trace(char *tracedir, char *filename, int fn_index)
 {
     FILE *tracefile;
     trace_t *trace;
+    bintrace_hdr_t hdr;
     char type[MAXLINE];
     char path[MAXLINE];
     unsigned index, size;
@@ -504,6 +813,8 @@ static trace_t *read_trace(char *tracedir, char *filename, int fn_index)
     /* Allocate the trace record */
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
+    trace->map = NULL;
+    trace->map_len = 0;
 	
     /* Read the trace file header */
     strcpy(path, tracedir);
@@ -512,15 +823,21 @@ static trace_t *read_trace(char *tracedir, char *filename, int fn_index)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    if (fread(&hdr, sizeof(hdr), 1, tracefile) == 1
+	&& memcmp(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic)) == 0)
+	map_bintrace(trace, fileno(tracefile), &hdr, path);
+    else {
+	rewind(tracefile);
+	fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%d", &(trace->num_ids));     
+	fscanf(tracefile, "%d", &(trace->num_ops));     
+	fscanf(tracefile, "%d", &(trace->weight));        /* not used */
     
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops = 
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	    unix_error("malloc 2 failed in read_trace");
+    }
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -531,6 +848,11 @@ static trace_t *read_trace(char *tracedir, char *filename, int fn_index)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+
+    if (trace->map != NULL) {
+	fclose(tracefile);
+	return trace;
+    }
     
     /* read every request line in the trace file */
     index = 0;
@@ -571,13 +893,58 @@ static trace_t *read_trace(char *tracedir, char *filename, int fn_index)
     return trace;
 }
 
+/*
+ * write_bintrace - write a trace in the binary format that read_trace
+ *     maps. The output replaces a ".rep" suffix of filename with ".bin".
+ */
+static void write_bintrace(trace_t *trace, char *tracedir, char *filename)
+{
+    FILE *binfile;
+    bintrace_hdr_t hdr;
+    char path[MAXLINE];
+    size_t len;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    len = strlen(path);
+    if (len > 4 && strcmp(path + len - 4, ".rep") == 0)
+	path[len - 4] = 0;
+    strcat(path, ".bin");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.op_size = sizeof(traceop_t);
+    hdr.sugg_heapsize = trace->sugg_heapsize;
+    hdr.num_ids = trace->num_ids;
+    hdr.num_ops = trace->num_ops;
+    hdr.weight = trace->weight;
+
+    if ((binfile = fopen(path, "w")) == NULL) {
+	sprintf(msg, "Could not create %s in write_bintrace", path);
+	unix_error(msg);
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, binfile) != 1
+	|| fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, binfile) 
+	   != (size_t)trace->num_ops
+	|| fclose(binfile) != 0) {
+	sprintf(msg, "Could not write %s in write_bintrace", path);
+	unix_error(msg);
+    }
+    if (verbose > 1)
+	printf("Wrote %s\n", path);
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(). The
+ *              ops of a binary trace are unmapped instead.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* free the three arrays... */
+	munmap(trace->map, trace->map_len);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -591,11 +958,11 @@ void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges, int checks, int chaos)
+static int eval_mm_valid(trace_t *trace, int tracenum, llrb_node **ranges, int checks, int chaos)
 {
-    int i, non_free_op = 0;
+    int i, j, non_free_op = 0;
     int index;
-    int size;
+    int size, oldsize;
     char *newp;
     char *oldp;
     char *p;
@@ -658,16 +1025,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges, int che
 	    trace->block_sizes[index] = size;
 	    break;
 
-        case REALLOC: /* mm_malloc + mm_free */
+        case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+            if (checks && !check_free(chaos, oldp))
+              return 0;
+	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
-            if (checks && !check(chaos, "malloc"))
+            if (checks && !check(chaos, "realloc"))
               return 0;
+            if (checks && newp != oldp)
+              check_post_free(chaos, oldp);
 
 	    /* Remove the old region from the range list */
 	    remove_range(ranges, oldp);
@@ -675,15 +1046,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges, int che
 	    /* Check new block for correctness and add it to range list */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
-	    memset(newp, index & 0xFF, size);
 
-            if (checks && !check_free(chaos, oldp))
-              return 0;
-            mm_free(oldp);
-            if (checks && !check(chaos, "free"))
-              return 0;
-            if (checks)
-              check_post_free(chaos, oldp);
+	    /* 
+	     * Make sure the new block contains the data from the old 
+	     * block, which eval_mm_valid filled with the low byte of the
+	     * index. Chaos mode may have mangled the payload, so only
+	     * check when it is off.
+	     */
+	    if (!chaos) {
+		oldsize = trace->block_sizes[index];
+		if (size < oldsize)
+		    oldsize = size;
+		for (j = 0; j < oldsize; j++) {
+		    if (newp[j] != (char)(index & 0xFF)) {
+			malloc_error(tracenum, i, "mm_realloc did not preserve "
+				     "the data from old block");
+			return 0;
+		    }
+		}
+	    }
+	    memset(newp, index & 0xFF, size);
 
 	    /* Remember region */
 	    trace->blocks[index] = newp;
@@ -723,14 +1105,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges, int che
  *   package on the trace. Note that our implementation of mem_sbrk() 
  *   doesn't allow the students to decrement the brk pointer, so brk
  *   is always the high water mark of the heap. 
- *   
+ *   The mem_map/mem_unmap/mem_purge call counts of the run, how many
+ *   map and unmap calls the allocator saved by reusing retained chunks,
+ *   and the mean mapped bytes over all ops and resident bytes over the
+ *   sampled ops go in map_stats.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, double *inst_ratio)
+static double eval_mm_util(trace_t *trace, int tracenum, llrb_node **ranges, double *inst_ratio,
+                           stats_t *map_stats)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
     size_t max_total_size = 0, max_heap_size = 0;
+    double sum_heap = 0, sum_resident = 0;
+    int resident_samples = 0;
     size_t heap_size = 0, total_size = 0;
     double ratio, ratio_frac, accum_ratio_frac = 1.0, accum_ratio_exp = 0.0;
     int ratio_exp;
@@ -761,17 +1149,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
 
             break;
 
-	case REALLOC: /* mm_mealloc + mm_free */
+	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_malloc(newsize)) == NULL)
+	    if ((newp = mm_realloc(oldp, newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
-            mm_free(oldp);
-
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
@@ -809,6 +1195,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
         heap_size = mem_heapsize();
         if (heap_size > max_heap_size)
           max_heap_size = heap_size;
+        sum_heap += heap_size;
+        if (i % RESIDENT_EVERY == RESIDENT_EVERY - 1 || i == trace->num_ops - 1) {
+            sum_resident += mem_resident();
+            resident_samples++;
+        }
 
         ratio = (double)(total_size + 1) / (heap_size + 1);
 
@@ -823,6 +1214,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, doubl
         // printf("%ld %ld %f\n", total_size, heap_size, ratio);
     }
 
+    map_stats->maps = mem_map_calls();
+    map_stats->unmaps = mem_unmap_calls();
+    map_stats->reused = mm_reused_chunks();
+    map_stats->purges = mem_purge_calls();
+    map_stats->heap = sum_heap / trace->num_ops;
+    map_stats->resident = resident_samples ? sum_resident / resident_samples : 0;
+
     mem_reset();
 
     ratio = accum_ratio_frac * pow(2, accum_ratio_exp / trace->num_ops);
@@ -861,13 +1259,12 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
-	case REALLOC: /* mm_malloc + mm_free */
+	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_malloc(newsize)) == NULL)
+            if ((newp = mm_realloc(oldp, newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
-            mm_free(oldp);
             trace->blocks[index] = newp;
             break;
 
@@ -884,6 +1281,164 @@ static void eval_mm_speed(void *ptr)
     mem_reset();
 }
 
+/*
+ * eval_mm_trace - Read one trace and evaluate the mm package on it:
+ *     correctness, defenses against chaos, space utilization and speed
+ */
+static void eval_mm_trace(char *filename, int tracenum, stats_t *stats,
+			  int checks, int repeats)
+{
+    static llrb_node *ranges = NULL;   /* keeps track of block extents */
+    static llrb_node *d_ranges = NULL; /*   for the valid and chaos runs */
+    speed_t speed_params;
+    trace_t *trace;
+    int j;
+
+    trace = read_trace(tracedir, filename, tracenum);
+    stats->ops = trace->num_ops;
+    if (verbose > 1) {
+	printf("Checking mm_malloc for correctness, ");
+	fflush(stdout);
+    }
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges, checks, 0);
+    if (stats->valid) {
+	if (checks && (repeats > 0)) {
+	    if (verbose > 1) {
+		printf("defensiveness, ");
+		fflush(stdout);
+	    }
+	    for (j = 0; j < repeats; j++)
+		(void)eval_mm_valid(trace, tracenum, &d_ranges, checks, 1);
+	}
+
+	if (verbose > 1) {
+	    printf("efficiency, ");
+	    fflush(stdout);
+	}
+	stats->util = eval_mm_util(trace, tracenum, &ranges, &stats->inst_util, stats);
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1) {
+	    printf("and performance.\n");
+	    fflush(stdout);
+	}
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+	fsecs_interval(&stats->secs_lo, &stats->secs_hi);
+	if (perf_want)
+	    eval_perf(eval_mm_speed, &speed_params, stats->perf);
+	if (latency)
+	    eval_latency(trace, 1, &stats->lat, mm_lat_by_op);
+	if (threads)
+	    eval_mm_threads(trace, tracenum, stats, checks);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_jobs - Evaluate the mm package on n traces with up to jobs
+ *     worker processes at once. Each worker is forked from main with
+ *     a fresh heap, evaluates one trace into shared memory and writes
+ *     its output to a file of its own, which is shown in trace order
+ *     as soon as the traces before it are done; so, timings aside, the
+ *     output is that of a serial run. A worker that fails ends the run
+ *     as the failure would have. Returns the most page map metadata
+ *     any worker had.
+ */
+static size_t eval_mm_jobs(char **tracefiles, int n, stats_t *stats,
+			   int checks, int repeats)
+{
+    job_t *job;
+    pid_t pid, *pids;
+    int i, k, next = 0, running = 0, shown = 0, status;
+    size_t len, map_bytes = 0;
+    char buf[MAXLINE];
+
+    job = mmap(NULL, n * sizeof(job_t), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (job == MAP_FAILED)
+	unix_error("mmap failed in eval_mm_jobs");
+    if ((pids = calloc(n, sizeof(pid_t))) == NULL)
+	unix_error("calloc failed in eval_mm_jobs");
+
+    while (shown < n) {
+	/* Start workers while there are traces left and room for them */
+	while (next < n && running < jobs) {
+	    if ((job[next].out = tmpfile()) == NULL)
+		unix_error("tmpfile failed in eval_mm_jobs");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_jobs");
+	    if (pid == 0) {
+		if (dup2(fileno(job[next].out), STDOUT_FILENO) < 0)
+		    unix_error("dup2 failed in eval_mm_jobs");
+		if (perf_want)
+		    perf_open(0);
+		eval_mm_trace(tracefiles[next], next, &job[next].stats,
+			      checks, repeats);
+		job[next].errors = errors;
+		job[next].map_bytes = pagemap_bytes();
+		memcpy(job[next].thread_ops, thread_ops, sizeof(thread_ops));
+		memcpy(job[next].thread_secs, thread_secs, sizeof(thread_secs));
+		memcpy(job[next].lat_by_op, mm_lat_by_op, sizeof(mm_lat_by_op));
+		fflush(stdout);
+		_exit(0);
+	    }
+	    pids[next++] = pid;
+	    running++;
+	}
+
+	/* Wait for some worker to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_mm_jobs");
+	for (i = 0; i < next && pids[i] != pid; i++)
+	    ;
+	if (i == next)
+	    continue;
+	job[i].status = status;
+	pids[i] = 0;
+	running--;
+
+	/* Show the output of the finished traces that are next in order */
+	while (shown < next && pids[shown] == 0) {
+	    fflush(stdout);
+	    rewind(job[shown].out);
+	    while ((len = fread(buf, 1, sizeof(buf), job[shown].out)) > 0)
+		fwrite(buf, 1, len, stdout);
+	    fclose(job[shown].out);
+	    status = job[shown].status;
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (WIFSIGNALED(status))
+		    printf("Worker for trace %d killed by signal %d\n",
+			   shown, WTERMSIG(status));
+		for (k = shown + 1; k < next; k++)
+		    if (pids[k] != 0)
+			kill(pids[k], SIGKILL);
+		exit(1);
+	    }
+	    shown++;
+	}
+    }
+
+    /* Gather what main would have seen from a serial run */
+    for (i = 0; i < n; i++) {
+	stats[i] = job[i].stats;
+	errors += job[i].errors;
+	if (job[i].map_bytes > map_bytes)
+	    map_bytes = job[i].map_bytes;
+	for (k = 0; k < MAX_THREADS; k++) {
+	    thread_ops[k] += job[i].thread_ops[k];
+	    thread_secs[k] += job[i].thread_secs[k];
+	}
+	for (k = 0; k < LAT_OPS * LAT_SIZES; k++)
+	    lat_merge(&mm_lat_by_op[k / LAT_SIZES][k % LAT_SIZES],
+		      &job[i].lat_by_op[k / LAT_SIZES][k % LAT_SIZES]);
+    }
+
+    free(pids);
+    munmap(job, n * sizeof(job_t));
+    return map_bytes;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -954,10 +1509,9 @@ static void eval_libc_speed(void *ptr)
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-	    if ((newp = malloc(newsize)) == NULL)
-		unix_error("malloc failed in eval_libc_speed\n");
-            free(oldp);
-	    
+	    if ((newp = realloc(oldp, newsize)) == NULL)
+		unix_error("realloc failed in eval_libc_speed\n");
+
 	    trace->blocks[index] = newp;
 	    break;
 	    
@@ -970,6 +1524,337 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*************************************************************
+ * The following routines replay a trace on several threads at
+ * once. Each thread gets the requests of the ids that are equal
+ * to its number modulo the thread count, so every block is
+ * allocated, resized and freed by one thread, in trace order.
+ * With -X a block's free goes to the next thread instead, which
+ * waits for the block's earlier requests before it frees it.
+ ************************************************************/
+
+/* replay_owner - the thread that runs request op of a trace on n threads */
+static int replay_owner(traceop_t *op, int n)
+{
+    return (op->index + (cross_frees && op->type == FREE)) % n;
+}
+
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    traceop_t *op;
+    int i;
+
+    pthread_barrier_wait(&replay_barrier);
+    r->start = lat_now();
+    for (i = 0; i < r->num_ops; i++) {
+	op = &trace->ops[r->ops[i]];
+	if (r->done != NULL)
+	    while (__atomic_load_n(&r->done[op->index], __ATOMIC_ACQUIRE) 
+		   != r->seq[r->ops[i]])
+		sched_yield();
+        switch (op->type) {
+        case ALLOC:
+	    if ((trace->blocks[op->index] = mm_malloc(op->size)) == NULL)
+		app_error("mm_malloc error in replay_thread");
+	    break;
+
+	case REALLOC:
+	    if ((trace->blocks[op->index] = 
+		 mm_realloc(trace->blocks[op->index], op->size)) == NULL)
+		app_error("mm_realloc error in replay_thread");
+	    break;
+
+        case FREE:
+	    mm_free(trace->blocks[op->index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+	}
+	if (r->done != NULL)
+	    __atomic_store_n(&r->done[op->index], r->seq[r->ops[i]] + 1, 
+			     __ATOMIC_RELEASE);
+    }
+    r->end = lat_now();
+    return NULL;
+}
+
+/*
+ * replay_threads - replay a trace THREAD_RUNS times on n threads and
+ *     return the best wall time, from the first thread starting to the
+ *     last one finishing. The per-thread times of that run are added
+ *     to the thread totals if record is set.
+ */
+static double replay_threads(trace_t *trace, int tracenum, int n, 
+			     int checks, int record)
+{
+    replay_t r[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    double best_secs[MAX_THREADS];
+    double secs, best = DBL_MAX;
+    unsigned long long start, end;
+    int *ops, *seq = NULL, *done = NULL, i, t, run;
+
+    /* Deal the requests out to the threads by id */
+    if ((ops = (int *)malloc(trace->num_ops * sizeof(int))) == NULL)
+	unix_error("malloc failed in replay_threads");
+    if (cross_frees) {
+	seq = (int *)malloc(trace->num_ops * sizeof(int));
+	done = (int *)calloc(trace->num_ids > 0 ? trace->num_ids : 1, 
+			     sizeof(int));
+	if (seq == NULL || done == NULL)
+	    unix_error("malloc failed in replay_threads");
+	for (i = 0; i < trace->num_ops; i++)
+	    seq[i] = done[trace->ops[i].index]++;
+    }
+    for (t = 0; t < n; t++) {
+	r[t].trace = trace;
+	r[t].num_ops = 0;
+	r[t].seq = seq;
+	r[t].done = done;
+    }
+    for (i = 0; i < trace->num_ops; i++)
+	r[replay_owner(&trace->ops[i], n)].num_ops++;
+    r[0].ops = ops;
+    for (t = 1; t < n; t++)
+	r[t].ops = r[t-1].ops + r[t-1].num_ops;
+    for (t = 0; t < n; t++)
+	r[t].num_ops = 0;
+    for (i = 0; i < trace->num_ops; i++) {
+	t = replay_owner(&trace->ops[i], n);
+	r[t].ops[r[t].num_ops++] = i;
+    }
+
+    for (run = 0; run < THREAD_RUNS; run++) {
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in replay_threads");
+	if (done != NULL)
+	    memset(done, 0, (trace->num_ids > 0 ? trace->num_ids : 1) * sizeof(int));
+
+	pthread_barrier_init(&replay_barrier, NULL, n + 1);
+	for (t = 0; t < n; t++)
+	    if (pthread_create(&tid[t], NULL, replay_thread, &r[t]) != 0)
+		unix_error("pthread_create failed in replay_threads");
+	pthread_barrier_wait(&replay_barrier);
+	for (t = 0; t < n; t++)
+	    pthread_join(tid[t], NULL);
+	pthread_barrier_destroy(&replay_barrier);
+
+	start = r[0].start;
+	end = r[0].end;
+	for (t = 1; t < n; t++) {
+	    start = r[t].start < start ? r[t].start : start;
+	    end = r[t].end > end ? r[t].end : end;
+	}
+	secs = (end - start) / 1e9;
+
+	if (checks && !mm_check()) {
+	    sprintf(msg, "mm_check failed after replay on %d threads", n);
+	    malloc_error(tracenum, trace->num_ops - 1, msg);
+	}
+	mem_reset();
+
+	if (secs < best) {
+	    best = secs;
+	    for (t = 0; t < n; t++)
+		best_secs[t] = (r[t].end - r[t].start) / 1e9;
+	}
+    }
+
+    if (record)
+	for (t = 0; t < n; t++) {
+	    thread_ops[t] += r[t].num_ops;
+	    thread_secs[t] += best_secs[t];
+	}
+    free(ops);
+    free(seq);
+    free(done);
+    return best;
+}
+
+/*
+ * eval_mm_threads - Replay a trace with each thread count of the 
+ *     scaling curve, recording the wall time of each
+ */
+static void eval_mm_threads(trace_t *trace, int tracenum, stats_t *stats,
+			    int checks)
+{
+    int k;
+
+    for (k = 0; k < num_scale; k++)
+	stats->tsecs[k] = replay_threads(trace, tracenum, scale[k], checks,
+					 k == num_scale - 1);
+}
+
+/*************************************************************
+ * The following routines measure the latency of each request
+ * and keep the results in log-linear histograms.
+ ************************************************************/
+
+static inline unsigned long long lat_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* lat_calibrate - the least time seen between two back-to-back reads */
+static void lat_calibrate(void)
+{
+    unsigned long long t0, t1;
+    int i;
+
+    lat_overhead = ~0ULL;
+    for (i = 0; i < 1000; i++) {
+	t0 = lat_now();
+	t1 = lat_now();
+	if (t1 - t0 < lat_overhead)
+	    lat_overhead = t1 - t0;
+    }
+}
+
+static int lat_bucket(unsigned long long ns)
+{
+    int e;
+
+    if (ns < LAT_SUB)
+	return (int)ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB 
+	+ (int)((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* lat_bucket_max - the largest value that falls into bucket b */
+static unsigned long long lat_bucket_max(int b)
+{
+    int e;
+
+    if (b < LAT_SUB)
+	return b;
+    e = b / LAT_SUB + LAT_SUB_BITS - 1;
+    return ((unsigned long long)(LAT_SUB + b % LAT_SUB + 1) 
+	    << (e - LAT_SUB_BITS)) - 1;
+}
+
+static void lat_record(lat_hist_t *h, unsigned long long ns)
+{
+    h->count++;
+    h->bucket[lat_bucket(ns)]++;
+    if (ns > h->max)
+	h->max = ns;
+}
+
+static void lat_merge(lat_hist_t *dst, lat_hist_t *src)
+{
+    int b;
+
+    dst->count += src->count;
+    for (b = 0; b < LAT_BUCKETS; b++)
+	dst->bucket[b] += src->bucket[b];
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/* 
+ * lat_percentile - an upper bound on the q-quantile of h: the top of
+ *     the bucket holding it, which is never reported above the max
+ */
+static unsigned long long lat_percentile(lat_hist_t *h, double q)
+{
+    unsigned long seen = 0, rank = (unsigned long)ceil(q * h->count);
+    int b;
+
+    if (rank == 0)
+	rank = 1;
+    for (b = 0; b < LAT_BUCKETS; b++) {
+	seen += h->bucket[b];
+	if (seen >= rank)
+	    break;
+    }
+    return (b < LAT_BUCKETS && lat_bucket_max(b) < h->max) 
+	? lat_bucket_max(b) : h->max;
+}
+
+/* lat_size_class - index of size in <=64, <=256, <=1K, ... >256K */
+static int lat_size_class(int size)
+{
+    int cls = 0, limit = 64;
+
+    while (size > limit && cls < LAT_SIZES - 1) {
+	limit <<= 2;
+	cls++;
+    }
+    return cls;
+}
+
+/*
+ * eval_latency - Replay a trace once more with mm (use_mm) or libc,
+ *     timing every request on its own. The cost of reading the clock
+ *     is subtracted from each sample. Frees are classed by the size
+ *     the block was last given.
+ */
+static void eval_latency(trace_t *trace, int use_mm, lat_hist_t *all,
+			 lat_hist_t by_op[LAT_OPS][LAT_SIZES])
+{
+    int i, index, size = 0;
+    char *p = NULL;
+    unsigned long long t0, t1, ns;
+
+    if (lat_overhead == 0)
+	lat_calibrate();
+    if (use_mm && mm_init() < 0) 
+	app_error("mm_init failed in eval_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+	    size = trace->ops[i].size;
+	    t0 = lat_now();
+	    p = use_mm ? mm_malloc(size) : malloc(size);
+	    t1 = lat_now();
+	    break;
+
+	case REALLOC:
+	    size = trace->ops[i].size;
+	    t0 = lat_now();
+	    p = use_mm ? mm_realloc(trace->blocks[index], size) 
+		: realloc(trace->blocks[index], size);
+	    t1 = lat_now();
+	    break;
+	    
+        case FREE:
+	    size = trace->block_sizes[index];
+	    p = trace->blocks[index];
+	    t0 = lat_now();
+	    if (use_mm)
+		mm_free(p);
+	    else
+		free(p);
+	    t1 = lat_now();
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_latency");
+	}
+
+	if (p == NULL)
+	    app_error("malloc error in eval_latency");
+	trace->blocks[index] = p;
+	trace->block_sizes[index] = size;
+
+	ns = (t1 - t0 > lat_overhead) ? t1 - t0 - lat_overhead : 0;
+	lat_record(all, ns);
+	lat_record(&by_op[trace->ops[i].type][lat_size_class(size)], ns);
+    }
+
+    if (use_mm)
+	mem_reset();
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -986,6 +1871,8 @@ static int check(int chaos, const char *what)
     if (!mm_check()) {
       if (!strcmp(what, "alloc"))
         app_error("mm_check failed after alloc");
+      else if (!strcmp(what, "realloc"))
+        app_error("mm_check failed after realloc");
       else
         app_error("mm_check failed after free");
     }
@@ -1060,6 +1947,129 @@ static void mangle(void)
   pagemap_for_each(mangle_page, 0);
 }
 
+/*************************************************************
+ * The following routines count hardware events over a few more
+ * replays with a perf_event_open group (-P; dTLB misses with -H).
+ ************************************************************/
+
+/*
+ * perf_open - Open a counter of this process's user-mode events for
+ *     every event in perf_want, all in one group so that they count
+ *     over the same instructions. Events the kernel or the machine
+ *     lacks (virtual machines often have none) are left at -1 and,
+ *     if report is set, named once.
+ */
+static void perf_open(int report)
+{
+    static const struct { unsigned type; unsigned long long config; } events[PERF_EVENTS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	  (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+	  (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    struct perf_event_attr attr;
+    int e, missing = 0, err = 0;
+
+    /* A worker (-j) reopens the counters for itself */
+    for (e = 0; e < PERF_EVENTS && perf_leader >= 0; e++)
+	if (perf_fd[e] >= 0)
+	    close(perf_fd[e]);
+    perf_leader = -1;
+
+    for (e = 0; e < PERF_EVENTS; e++) {
+	perf_fd[e] = -1;
+	if (!(perf_want & (1 << e)))
+	    continue;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[e].type;
+	attr.config = events[e].config;
+	attr.disabled = (perf_leader < 0);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+	    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	perf_fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, perf_leader, 0);
+	if (perf_fd[e] < 0 && report) {
+	    if (!missing++)
+		printf("Hardware events unavailable (%s):", strerror(errno));
+	    printf(" %s", perf_names[e]);
+	    err = 1;
+	}
+	else if (perf_leader < 0)
+	    perf_leader = perf_fd[e];
+    }
+    if (err)
+	printf("\n");
+}
+
+/*
+ * eval_perf - Replay the trace PERF_RUNS times with f while the group
+ *     counts, and set perf[e] to event e per op, scaled up for any time
+ *     the kernel had the group off the counters, or to -1 if unknown.
+ */
+static void eval_perf(void (*f)(void *), speed_t *params, double *perf)
+{
+    struct { unsigned long long value, id; } *v;
+    unsigned long long buf[3 + 2 * PERF_EVENTS], id, scale_num, scale_den;
+    int e, k, r;
+
+    for (e = 0; e < PERF_EVENTS; e++)
+	perf[e] = -1;
+    if (perf_leader < 0)
+	return;
+
+    ioctl(perf_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    for (r = 0; r < PERF_RUNS; r++)
+	f(params);
+    ioctl(perf_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    /* nr, time enabled, time running, then a value and id per event */
+    if (read(perf_leader, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(buf[0])))
+	return;
+    scale_num = buf[1];
+    scale_den = buf[2];
+    if (scale_den == 0)
+	return;
+    v = (void *)&buf[3];
+    for (k = 0; k < (int)buf[0] && k < PERF_EVENTS; k++)
+	for (e = 0; e < PERF_EVENTS; e++)
+	    if (perf_fd[e] >= 0 && ioctl(perf_fd[e], PERF_EVENT_IOC_ID, &id) == 0 &&
+		id == v[k].id)
+		perf[e] = (double)v[k].value * scale_num / scale_den /
+		    ((double)PERF_RUNS * params->trace->num_ops);
+}
+
+/* printperf - a column per counted event, or a dash when unknown */
+static void printperf(double *perf)
+{
+    int e;
+
+    for (e = 0; e < PERF_EVENTS; e++)
+	if (perf_want & (1 << e)) {
+	    if (perf[e] < 0)
+		printf("%9s", "-");
+	    else
+		printf("%9.3f", perf[e]);
+	}
+}
+
+/*
+ * printinterval - the confidence interval around secs as the larger of
+ *     its distances from secs, in percent of secs
+ */
+static void printinterval(double secs, double lo, double hi)
+{
+    double d = (hi - secs > secs - lo) ? hi - secs : secs - lo;
+
+    printf("%6.1f%%", secs > 0 ? 100 * d / secs : 0.0);
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -1070,13 +2080,28 @@ static void printresults(int n, stats_t *stats)
     double ops = 0;
     double util = 0;
     double inst_util = 0;
+    double secs_lo = 0, secs_hi = 0;
+    double perf[PERF_EVENTS];
+    static lat_hist_t lat;
+    int e;
+
+    memset(&lat, 0, sizeof(lat));
+    memset(perf, 0, sizeof(perf));
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%7s%7s%10s%6s\n", 
+    printf("%5s%7s %5s%7s%7s%10s%6s", 
 	   "trace", " valid", "util", "util_i", "ops", "secs", "Kops");
+    if (USE_TSC)
+	printf("%7s", "+-%");
+    for (e = 0; e < PERF_EVENTS; e++)
+	if (perf_want & (1 << e))
+	    printf("%9s", perf_names[e]);
+    if (latency)
+	printf("%7s%7s%7s%7s%8s", "p50", "p90", "p99", "p99.9", "max");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
@@ -1084,10 +2109,25 @@ static void printresults(int n, stats_t *stats)
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (USE_TSC)
+		printinterval(stats[i].secs, stats[i].secs_lo, stats[i].secs_hi);
+	    if (perf_want)
+		printperf(stats[i].perf);
+	    if (latency)
+		printlatency(&stats[i].lat);
+	    printf("\n");
+	    lat_merge(&lat, &stats[i].lat);
 	    secs += stats[i].secs;
+	    secs_lo += stats[i].secs_lo;
+	    secs_hi += stats[i].secs_hi;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
 	    inst_util += stats[i].inst_util;
+	    for (e = 0; e < PERF_EVENTS; e++)
+		if (perf[e] >= 0 && stats[i].perf[e] >= 0)
+		    perf[e] += stats[i].perf[e] * stats[i].ops;
+		else
+		    perf[e] = -1;
 	}
 	else {
 	    printf("%2d%10s%6s%8s%10s%6s\n", 
@@ -1102,13 +2142,24 @@ static void printresults(int n, stats_t *stats)
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       (inst_util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (USE_TSC)
+	    printinterval(secs, secs_lo, secs_hi);
+	if (perf_want) {
+	    for (e = 0; e < PERF_EVENTS; e++)
+		if (perf[e] >= 0)
+		    perf[e] /= ops;
+	    printperf(perf);
+	}
+	if (latency)
+	    printlatency(&lat);
+	printf("\n");
     }
     else {
 	printf("%12s%6s%6s%8s%10s%6s\n", 
@@ -1122,6 +2173,137 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printmapresults - prints how often the mm package mapped and unmapped
+ *     memory during the util run, how many of those calls reusing
+ *     retained chunks saved (one map and one unmap per reused chunk),
+ *     how often it purged free pages, and its mean mapped and resident
+ *     bytes
+ */
+static void printmapresults(int n, stats_t *stats, size_t map_bytes)
+{
+    int i;
+    double maps = 0, unmaps = 0, reused = 0, purges = 0, heap = 0, resident = 0;
+
+    printf("%5s%7s %8s%8s%8s%8s%10s%10s\n", "trace", " valid", "maps", "unmaps", "saved",
+	   "purges", "heap KB", "rss KB");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%10s%8.0f%8.0f%8.0f%8.0f%10.0f%10.0f\n",
+		   i,
+		   "yes",
+		   stats[i].maps,
+		   stats[i].unmaps,
+		   2 * stats[i].reused,
+		   stats[i].purges,
+		   stats[i].heap / 1024,
+		   stats[i].resident / 1024);
+	    maps += stats[i].maps;
+	    unmaps += stats[i].unmaps;
+	    reused += stats[i].reused;
+	    purges += stats[i].purges;
+	    heap += stats[i].heap;
+	    resident += stats[i].resident;
+	}
+	else {
+	    printf("%2d%10s%8s%8s%8s%8s%10s%10s\n", i, "no", "-", "-", "-", "-", "-", "-");
+	}
+    }
+    printf("%12s%8.0f%8.0f%8.0f%8.0f%10.0f%10.0f\n", "Total       ", maps, unmaps, 2 * reused,
+	   purges, heap / 1024, resident / 1024);
+    printf("Page map metadata: %lu KB\n", (unsigned long)(map_bytes / 1024));
+}
+
+/*
+ * printlatency - print the percentile columns of one latency histogram
+ */
+static void printlatency(lat_hist_t *h)
+{
+    printf("%7llu%7llu%7llu%7llu%8llu",
+	   lat_percentile(h, 0.50),
+	   lat_percentile(h, 0.90),
+	   lat_percentile(h, 0.99),
+	   lat_percentile(h, 0.999),
+	   h->max);
+}
+
+/* 
+ * printlatresults - print the latency of each kind of request, broken
+ *     down by request size, over all of the traces
+ */
+static void printlatresults(lat_hist_t by_op[LAT_OPS][LAT_SIZES])
+{
+    static char *op_names[LAT_OPS] = {"malloc", "free", "realloc"};
+    static char *size_names[LAT_SIZES] = {
+	"<=64", "<=256", "<=1K", "<=4K", "<=16K", "<=64K", "<=256K", ">256K"
+    };
+    int op, cls;
+
+    printf("%-8s%7s%9s%7s%7s%7s%7s%8s\n", 
+	   "request", "size", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (op = 0; op < LAT_OPS; op++)
+	for (cls = 0; cls < LAT_SIZES; cls++) {
+	    if (by_op[op][cls].count == 0)
+		continue;
+	    printf("%-8s%7s%9lu", op_names[op], size_names[cls], 
+		   by_op[op][cls].count);
+	    printlatency(&by_op[op][cls]);
+	    printf("\n");
+	}
+}
+
+/* 
+ * printthreadresults - print the aggregate Kops of each trace at each
+ *     thread count, the speedup over one thread, and how each thread
+ *     did at the most threads
+ */
+static void printthreadresults(int n, stats_t *stats)
+{
+    double ops = 0, secs[MAX_SCALE], kops[MAX_SCALE];
+    char label[16];
+    int i, k;
+
+    printf("%5s%7s ", "trace", " valid");
+    for (k = 0; k < num_scale; k++) {
+	sprintf(label, "%dT", scale[k]);
+	printf("%9s", label);
+	secs[k] = 0;
+    }
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%10s ", i, "yes");
+	    for (k = 0; k < num_scale; k++) {
+		printf("%9.0f", (stats[i].ops/1e3)/stats[i].tsecs[k]);
+		secs[k] += stats[i].tsecs[k];
+	    }
+	    ops += stats[i].ops;
+	}
+	else {
+	    printf("%2d%10s ", i, "no");
+	    for (k = 0; k < num_scale; k++)
+		printf("%9s", "-");
+	}
+	printf("\n");
+    }
+
+    printf("%-13s", "Total");
+    for (k = 0; k < num_scale; k++) {
+	kops[k] = (ops/1e3)/secs[k];
+	printf("%9.0f", kops[k]);
+    }
+    printf("\n%-13s", "Speedup");
+    for (k = 0; k < num_scale; k++)
+	printf("%9.2f", kops[k]/kops[0]);
+    printf("\n");
+
+    printf("\nPer-thread replay with %d threads:\n", threads);
+    printf("%6s%10s%10s%9s\n", "thread", "ops", "secs", "Kops");
+    for (k = 0; k < threads; k++)
+	printf("%6d%10.0f%10.6f%9.0f\n", k, thread_ops[k], thread_secs[k],
+	       thread_ops[k] > 0 ? (thread_ops[k]/1e3)/thread_secs[k] : 0.0);
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1154,7 +2336,7 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-nhvVal] [-f <file>] [-t <dir>] [-s <seed>] [-r <reps>]\n");
+    fprintf(stderr, "Usage: mdriver [-nhvValcLHPX] [-f <file>] [-t <dir>] [-s <seed>] [-r <reps>] [-T <threads>] [-j <jobs>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-n         Skip mm_check and mm_can_free correctness.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
@@ -1165,4 +2347,11 @@ static void usage(void)
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-q         Quiet: not per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-c         Convert the traces to binary .bin files and exit.\n");
+    fprintf(stderr, "\t-L         Report per-request latency percentiles.\n");
+    fprintf(stderr, "\t-H         Map huge pages and report dTLB misses per op.\n");
+    fprintf(stderr, "\t-P         Report cycles, instructions and cache, dTLB and branch misses per op.\n");
+    fprintf(stderr, "\t-T <n>     Also replay the traces on 1, 2, 4, ... up to <n> threads.\n");
+    fprintf(stderr, "\t-X         With -T, free each block on the thread after its allocator's.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> mm traces at once in worker processes.\n");
 }
@@ -9,14 +9,162 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <sched.h>
 
 #include "memlib.h"
 #include "pagemap.h"
+#include "llrb.h"
 
-/* private variables */
+/* private variables; the counters are updated atomically because
+   mem_map and mem_unmap may be called from several threads */
 static int activity_counter = 0; /* to simulate other processes */
 
 static int page_count;
+static int huge_pages;    /* map huge-page multiples on huge-page boundaries */
+static int tracking = 1;  /* keep the extents and the page map */
+static size_t map_calls, unmap_calls, purge_calls; /* since the last mem_reset */
+
+#define RESIDENT_WINDOW 4096  /* pages per mincore call */
+
+/* Mapped memory as maximal extents of adjacent pages, kept in a
+   left-leaning red-black tree (llrb.h) ordered by start and guarded by a spin
+   lock. The page map is updated a range at a time alongside it, for the
+   driver's lock-free per-page lookups. */
+typedef struct extent {
+  llrb_node link;               /* first, so an llrb_node is an extent */
+  char *start, *end;            /* [start, end) */
+} extent;
+
+#define EXTENT(h) ((extent *)(h))
+
+static llrb_node *extents;
+static int extent_lock;
+
+/* A test-and-test-and-set lock; a waiter yields its CPU, since the
+   holder may be preempted when there are more threads than cores */
+static void lock_extents(void)
+{
+  while (__atomic_exchange_n(&extent_lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&extent_lock, __ATOMIC_RELAXED))
+      sched_yield();
+}
+
+static void unlock_extents(void)
+{
+  __atomic_store_n(&extent_lock, 0, __ATOMIC_RELEASE);
+}
+
+static int extent_cmp(const llrb_node *a, const llrb_node *b)
+{
+  return EXTENT(a)->start < EXTENT(b)->start ? -1 : EXTENT(a)->start > EXTENT(b)->start;
+}
+
+/* extent_floor - the extent with the greatest start <= p, if any */
+static extent *extent_floor(char *p)
+{
+  llrb_node *h = extents;
+  extent *best = NULL;
+
+  while (h != NULL) {
+    if (EXTENT(h)->start <= p) {
+      best = EXTENT(h);
+      h = h->right;
+    } else
+      h = h->left;
+  }
+  return best;
+}
+
+/* extent_ceil - the extent with the least start >= p, if any */
+static extent *extent_ceil(char *p)
+{
+  llrb_node *h = extents;
+  extent *best = NULL;
+
+  while (h != NULL) {
+    if (EXTENT(h)->start >= p) {
+      best = EXTENT(h);
+      h = h->left;
+    } else
+      h = h->right;
+  }
+  return best;
+}
+
+static void extent_add(char *start, char *end)
+{
+  extent *e;
+
+  e = malloc(sizeof(extent));
+  if (e == NULL) {
+    fprintf(stderr, "out of memory for the extent index\n");
+    abort();
+  }
+  e->start = start;
+  e->end = end;
+  llrb_insert(&extents, &e->link, extent_cmp);
+}
+
+static void extent_remove(extent *e)
+{
+  llrb_remove(&extents, &e->link, extent_cmp);
+  free(e);
+}
+
+/* extent_resident - count the resident pages of every extent, walking
+   the tree with an explicit stack and asking mincore about a bounded
+   window at a time so that nothing is allocated; called with the extent
+   lock held */
+static size_t extent_resident(void)
+{
+  unsigned char vec[RESIDENT_WINDOW];
+  llrb_node *stack[2 * (sizeof(void *) * 8)];
+  extent *h;
+  size_t n = 0, pages, i;
+  char *p;
+  int depth = 0;
+
+  if (extents)
+    stack[depth++] = extents;
+  while (depth > 0) {
+    h = EXTENT(stack[--depth]);
+    for (p = h->start; p < h->end; p += pages * APAGE_SIZE) {
+      pages = (h->end - p) / APAGE_SIZE;
+      if (pages > RESIDENT_WINDOW)
+        pages = RESIDENT_WINDOW;
+      if (mincore(p, pages * APAGE_SIZE, vec) < 0) {
+        fprintf(stderr, "unexpected error in mincore: %s (%d)\n",
+                strerror(errno), errno);
+        abort();
+      }
+      for (i = 0; i < pages; i++)
+        n += vec[i] & 1;
+    }
+    if (h->link.left)
+      stack[depth++] = h->link.left;
+    if (h->link.right)
+      stack[depth++] = h->link.right;
+  }
+  return n;
+}
+
+/* extent_release - munmap and free every extent below h */
+static void extent_release(llrb_node *n)
+{
+  extent *h = EXTENT(n);
+
+  if (h == NULL)
+    return;
+  extent_release(n->left);
+  extent_release(n->right);
+  pagemap_modify_range(h->start, h->end - h->start, 0);
+  if (munmap(h->start, h->end - h->start) < 0) {
+    fprintf(stderr, "unexpected error in munmap: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+  free(h);
+}
 
 /* 
  * mem_init - initialize the memory system model
@@ -31,23 +179,47 @@ void mem_init(void)
   }
 }
 
-static void unmap(void *p)
-{
-  if (munmap(p, APAGE_SIZE) < 0) {
-    fprintf(stderr, "unexpected error in munmap: %s (%d)\n",
-            strerror(errno), errno);
-    abort();
-  }
-}
-
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_reset(void)
 {
-  pagemap_for_each(unmap, 1);
+  extent_release(extents);
+  extents = NULL;
   page_count = 0;
   activity_counter = 0;
+  map_calls = 0;
+  unmap_calls = 0;
+  purge_calls = 0;
+}
+
+/*
+ * mem_set_hugepages - with on set, mem_map aligns every request that is a
+ *   multiple of HPAGE_SIZE to HPAGE_SIZE and asks for transparent huge
+ *   pages there
+ */
+void mem_set_hugepages(int on)
+{
+  huge_pages = on;
+}
+
+/*
+ * mem_set_tracking - with on clear, mem_map and mem_unmap keep no extents
+ *   and no page map and map no stray pages, and so never call malloc;
+ *   mem_is_mapped then reports every range as mapped and mem_reset and
+ *   mem_resident see nothing. For running mm.c as the process's malloc.
+ */
+void mem_set_tracking(int on)
+{
+  tracking = on;
+}
+
+/*
+ * mem_hugepagesize - HPAGE_SIZE in huge page mode, 0 otherwise
+ */
+size_t mem_hugepagesize(void)
+{
+  return huge_pages ? HPAGE_SIZE : 0;
 }
 
 /*
@@ -60,14 +232,72 @@ size_t mem_pagesize()
 
 size_t mem_heapsize(void)
 {
-  return APAGE_SIZE * page_count;
+  return APAGE_SIZE * (size_t)__atomic_load_n(&page_count, __ATOMIC_RELAXED);
 }
 
+/*
+ * mem_map_calls, mem_unmap_calls - number of mem_map and mem_unmap calls
+ *   since the last mem_reset
+ */
+size_t mem_map_calls(void)
+{
+  return __atomic_load_n(&map_calls, __ATOMIC_RELAXED);
+}
 
+size_t mem_unmap_calls(void)
+{
+  return __atomic_load_n(&unmap_calls, __ATOMIC_RELAXED);
+}
+
+size_t mem_purge_calls(void)
+{
+  return __atomic_load_n(&purge_calls, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_resident - bytes of the mapped pages that have physical memory
+ *   behind them; unlike mem_heapsize, pages given back with mem_purge
+ *   or never touched do not count. Asks mincore about every extent.
+ */
+size_t mem_resident(void)
+{
+  size_t pages;
+
+  lock_extents();
+  pages = extent_resident();
+  unlock_extents();
+  return pages * APAGE_SIZE;
+}
+
+/*
+ * map_huge - map sz bytes on a huge page boundary by over-mapping and
+ *   trimming both ends, and mark them for transparent huge pages
+ */
+static void *map_huge(size_t sz)
+{
+  char *p, *aligned;
+
+  p = mmap(0, sz + HPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return p;
+  aligned = (char *)(((uintptr_t)p + HPAGE_SIZE - 1) & ~((uintptr_t)HPAGE_SIZE - 1));
+  if (aligned > p)
+    munmap(p, aligned - p);
+  if (aligned + sz < p + sz + HPAGE_SIZE)
+    munmap(aligned + sz, p + sz + HPAGE_SIZE - (aligned + sz));
+  /* Only a hint: the mapping works without huge pages */
+  (void)madvise(aligned, sz, MADV_HUGEPAGE);
+  return aligned;
+}
+
+/*
+ * mem_map - map sz bytes of fresh pages; NULL if the system has none
+ */
 void *mem_map(size_t sz)
 {
   void *p;
-  size_t i;
+  extent *prev, *next;
+  int activity;
   
   if (sz & (APAGE_SIZE - 1)) {
     fprintf(stderr, "mem_map: requested size is not a multiple of %d: %ld\n",
@@ -75,69 +305,118 @@ void *mem_map(size_t sz)
     abort();
   }
 
-  activity_counter++;
-  if ((activity_counter & (activity_counter - 1)) == 0) {
+  __atomic_fetch_add(&map_calls, 1, __ATOMIC_RELAXED);
+  activity = __atomic_add_fetch(&activity_counter, 1, __ATOMIC_RELAXED);
+  if (tracking && (activity & (activity - 1)) == 0) {
     /* allocate a page to ensure that mem_map results are not
        always sequential */
     mmap(0, APAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
   }
 
-  p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (p == MAP_FAILED) {
-    fprintf(stderr, "mmap failed: %s (%d)\n",
-            strerror(errno), errno);
-    abort();
-  }
+  if (huge_pages && (sz & (HPAGE_SIZE - 1)) == 0)
+    p = map_huge(sz);
+  else
+    p = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
 
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    pagemap_modify(p + i, 1);
-    page_count++;
+  __atomic_fetch_add(&page_count, (int)(sz / APAGE_SIZE), __ATOMIC_RELAXED);
+  if (!tracking)
+    return p;
+  pagemap_modify_range(p, sz, 1);
+
+  /* Join the new pages to the extents right before and after them */
+  lock_extents();
+  prev = extent_floor(p);
+  next = extent_ceil((char *)p + sz);
+  if (prev && prev->end > (char *)p) {
+    fprintf(stderr, "internal error: mmap returned mapped pages at %p\n", p);
+    abort();
   }
+  if (next && next->start != (char *)p + sz)
+    next = NULL;
+  if (prev && prev->end == (char *)p) {
+    prev->end = (char *)p + sz;
+    if (next) {
+      prev->end = next->end;
+      extent_remove(next);
+    }
+  } else if (next)
+    next->start = p;  /* still ordered: nothing lies between prev and next */
+  else
+    extent_add(p, (char *)p + sz);
+  unlock_extents();
   
   return p;
 }
 
-int check_mapped(void *p, size_t sz, int fail_with_error)
+/*
+ * check_mapped - whether [p, p + sz) is mapped. A misaligned p or sz
+ *   aborts with a message naming who, the caller; so does an unmapped
+ *   range when fail_with_error is set, and otherwise it returns 0.
+ */
+int check_mapped(const char *who, void *p, size_t sz, int fail_with_error)
 {
-  size_t i;
+  extent *e;
+  int ok;
 
+  if (!tracking)
+    return 1;
   if (((uintptr_t)p) & (APAGE_SIZE - 1)) {
-    fprintf(stderr, "mem_unmap: given address is not page-aligned: %p\n",
-            p);
+    fprintf(stderr, "%s: given address is not page-aligned: %p\n",
+            who, p);
     abort();
   }
 
   if (sz & (APAGE_SIZE - 1)) {
-    fprintf(stderr, "mem_unmap: given size is not a multiple of %d: %ld\n",
-            APAGE_SIZE, sz);
+    fprintf(stderr, "%s: given size is not a multiple of %d: %ld\n",
+            who, APAGE_SIZE, sz);
     abort();
   }
   
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    if (!pagemap_is_mapped(p+i)) {
-      if (fail_with_error) {
-        fprintf(stderr, "mem_unmap: given page is not mapped: %p (in %p:%p)\n",
-                p + i, p, p + sz);
-        abort();
-      }
-      return 0;
-    }
+  /* Extents are maximal, so a mapped range lies within a single one */
+  lock_extents();
+  e = extent_floor(p);
+  ok = e != NULL && e->end >= (char *)p + sz;
+  unlock_extents();
+  if (!ok && fail_with_error) {
+    fprintf(stderr, "%s: given range is not mapped: %p:%p\n",
+            who, p, p + sz);
+    abort();
   }
-
-  return 1;
+  return ok;
 }
 
-void mem_unmap(void *p, size_t sz)
+/* extent_cut - cut [p, end) out of its extent, splitting it if p is
+   inside, and out of the page map */
+static void extent_cut(char *p, char *end)
 {
-  size_t i;
+  extent *e;
 
-  (void)check_mapped(p, sz, 1);
-  
-  for (i = 0; i < sz; i += APAGE_SIZE) {
-    pagemap_modify(p + i, 0);
-    --page_count;
+  lock_extents();
+  e = extent_floor(p);
+  if (e->start == p && e->end == end)
+    extent_remove(e);
+  else if (e->start == p)
+    e->start = end;  /* still ordered: its successor starts at or after end */
+  else {
+    if (e->end != end)
+      extent_add(end, e->end);
+    e->end = p;
   }
+  unlock_extents();
+
+  pagemap_modify_range(p, end - p, 0);
+}
 
+void mem_unmap(void *p, size_t sz)
+{
+  (void)check_mapped("mem_unmap", p, sz, 1);
+  __atomic_fetch_add(&unmap_calls, 1, __ATOMIC_RELAXED);
+  if (tracking)
+    extent_cut(p, (char *)p + sz);
+
+  __atomic_fetch_sub(&page_count, (int)(sz / APAGE_SIZE), __ATOMIC_RELAXED);
   if (munmap(p, sz) < 0) {
     fprintf(stderr, "munmap failed: %s (%d)\n",
             strerror(errno), errno);
@@ -145,7 +424,22 @@ void mem_unmap(void *p, size_t sz)
   }
 }
 
+/*
+ * mem_purge - give the physical memory of mapped pages [p, p + sz) back
+ *   to the system; the pages stay mapped and read as zeros until written
+ */
+void mem_purge(void *p, size_t sz)
+{
+  (void)check_mapped("mem_purge", p, sz, 1);
+  __atomic_fetch_add(&purge_calls, 1, __ATOMIC_RELAXED);
+  if (madvise(p, sz, MADV_DONTNEED) < 0) {
+    fprintf(stderr, "madvise failed: %s (%d)\n",
+            strerror(errno), errno);
+    abort();
+  }
+}
+
 int mem_is_mapped(void *p, size_t sz)
 {
-  return check_mapped(p, sz, 0);
+  return check_mapped("mem_is_mapped", p, sz, 0);
 }
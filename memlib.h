@@ -4,8 +4,16 @@ void mem_init(void);
 void mem_reset(void);
 
 size_t mem_pagesize(void);
+void mem_set_hugepages(int on);
+void mem_set_tracking(int on);
+size_t mem_hugepagesize(void);
 void *mem_map(size_t);
 void mem_unmap(void *, size_t);
+void mem_purge(void *, size_t);
 int mem_is_mapped(void *p, size_t sz);
 
 size_t mem_heapsize(void);
+size_t mem_map_calls(void);
+size_t mem_unmap_calls(void);
+size_t mem_purge_calls(void);
+size_t mem_resident(void);
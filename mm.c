@@ -1,23 +1,66 @@
 /*
- * mm-naive.c - The least memory-efficient malloc package.
- * 
- * The following implemented allocator can be classified as an implicit coalescing
- * allocator with a few key details. "Chunks" or contiguous pages are mapped in a linked list
- * that can be found at the first 32 bytes of each chunk, the doubly linked list includes a next
- * and previous reference, along with that chunks size and a filler variable to keep payloads 16 byte aligned
- * Block headers and footers both have allocation bits, this is for mm_check to ensure that headers haven't been
- * mangled harshly. There includes an extending policy that adds 8 pages to the minimum request every 8 times
- * extend is called. There also includes an optimization in mm_malloc that searches the last page that a block was
- * allocated in.
+ * mm.c - A segregated-fit allocator over mapped chunks, with slabs,
+ *     per-thread caches and arenas.
+ *
+ * Layout: the heap is a list of "chunks", runs of pages from mem_map.
+ *     The first 32 bytes of a chunk are a page struct with the next and
+ *     previous chunk, the chunk's size and a stamp word. Blocks follow.
+ *     Every block has an 8-byte header packing its size, an allocated bit,
+ *     a previous-block-allocated bit and a first-block bit. Only free
+ *     blocks have a footer. A zero-size header ends the chunk. extend
+ *     grows the chunks it maps as the heap grows.
+ *
+ * Size classes: free blocks sit on explicit free lists, one per quarter
+ *     of each power of two, linked through their payloads. find_fit takes
+ *     the first fit in the request's own class, or the head of any larger
+ *     one. With -DBEST_FIT, free blocks of at least TREE_MIN_SIZE bytes go
+ *     in a red-black tree (llrb.h) keyed by size and address instead.
+ *
+ * Slabs: requests of at most SLAB_MAX_SIZE bytes come from page-sized
+ *     runs of one class each. A run header has a free bitmap, and objects
+ *     have no header; an object's run is found from its page start.
+ *     A few empty runs are kept per class, and a few more as spares any
+ *     class can carve again, before one is unmapped.
+ *
+ * Thread caches: each thread keeps a bounded cache of slab objects per
+ *     class, refilled and flushed in batches under an arena lock. A run
+ *     belongs to the cache of the thread that mapped it. Another thread
+ *     that frees one of its objects pushes it on that cache's lock-free
+ *     remote queue, which is closed when the owner exits; once the queue
+ *     holds TCACHE_REMOTE_MAX objects, it frees them under the arena lock.
+ *
+ * Arenas: all of the above lives in NUM_ARENAS independent heaps, each
+ *     behind a spin lock. A thread allocates from the arena it is given.
+ *     An allocated block names its arena in the top byte of its header,
+ *     and a slab run in its run header, so mm_free goes back to it.
+ *     mm_malloc, mm_free and mm_realloc may run in many threads at once;
+ *     mm_init, mm_check and mm_can_free may not.
+ *
+ * Large blocks: requests of at least LARGE_THRESHOLD bytes get a mapping
+ *     of their own, which mm_free unmaps directly.
+ *
+ * Returning memory: a chunk left empty is retained for reuse by extend,
+ *     up to RETAIN_BUDGET bytes over all arenas, and unmapped after RETAIN_DECAY frees
+ *     without reuse. A free block with at least PURGE_MIN bytes of whole
+ *     pages gives their physical memory back with mem_purge. In memlib's
+ *     huge page mode, chunks of a heap past HUGE_HEAP_MIN are whole huge
+ *     pages.
+ *
+ * When mem_map fails, the request fails and returns NULL. mm_usable_size
+ * and the mm_fork_ handlers let mmpreload.c stand in for the system malloc.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "llrb.h"
 
 /* always use 16-byte alignment */
 #define ALIGNMENT 16
@@ -31,26 +74,174 @@
 /* rounds down to the nearest multiple of mem_pagesize() */
 #define ADDRESS_PAGE_START(p) ((void *)(((size_t)p) & ~(mem_pagesize()-1)))
 
-#define OVERHEAD (sizeof(block_header)+sizeof(block_footer))
-#define BHSIZE (sizeof(block_header))
+#define WSIZE (sizeof(size_t))
 #define PGSIZE (sizeof(page))
 #define MAX_BLOCK_SIZE 1 << 32
 
 #define NEXT_PAGE(pg) (((page *)pg)->next)
 #define PREV_PAGE(pg) (((page *)pg)->prev)
 #define PAGE_SIZE(pg) (((page *)pg)->size)
-
-/* Get Header from payload pointer bp */ 
-#define HDRP(bp) ((char *)(bp) - sizeof(block_header))
-#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp))-OVERHEAD)
-
-#define GET_SIZE(p) ((block_header *)(p))->size
-#define GET_ALLOC(p) ((block_header *)(p))->allocated
-
-/* Payload of next block head pointer */
+#define PAGE_STAMP(pg) (((page *)pg)->stamp)
+
+/* Read and write a header or footer word */
+#define GET(p) (*(size_t *)(p))
+#define PUT(p, val) (*(size_t *)(p) = (val))
+#define PACK(size, flags) ((size) | (flags))
+
+/* Flags kept in the low bits of a header; sizes are multiples of ALIGNMENT */
+#define ALLOC_BIT 0x1      /* this block is allocated */
+#define PREV_ALLOC_BIT 0x2 /* the block before this one is allocated */
+#define LARGE_BIT 0x4      /* directly mapped large block */
+#define FIRST_BIT 0x8      /* first block of its chunk */
+#define FLAG_BITS (ALIGNMENT-1)
+
+/* The top byte of an allocated block's header names the arena that owns it */
+#define ARENA_SHIFT 56
+#define ARENA_BITS ((size_t)0xff << ARENA_SHIFT)
+#define ARENA_TAG(a) ((size_t)(a)->id << ARENA_SHIFT)
+#define GET_ARENA(p) (GET(p) >> ARENA_SHIFT)
+
+/* A free block whose whole pages have all been given back with mem_purge */
+#define PURGED_BIT ((size_t)1 << (ARENA_SHIFT - 1))
+
+#define GET_SIZE(p) (GET(p) & ~(size_t)FLAG_BITS & ~ARENA_BITS & ~PURGED_BIT)
+#define GET_ALLOC(p) (GET(p) & ALLOC_BIT)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC_BIT)
+#define SET_PREV_ALLOC(p) (GET(p) |= PREV_ALLOC_BIT)
+#define CLEAR_PREV_ALLOC(p) (GET(p) &= ~(size_t)PREV_ALLOC_BIT)
+
+/* Get Header from payload pointer bp; only free blocks have a footer */ 
+#define HDRP(bp) ((char *)(bp) - WSIZE)
+#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2*WSIZE)
+
+/* Payload of next block head pointer; PREV_BLKP needs a free previous block */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
-#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE((char *)(bp)- OVERHEAD))
-
+#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE((char *)(bp) - 2*WSIZE))
+
+/* The first block of a chunk (or a large block) follows the page struct */
+#define FIRST_BLKP(pg) ((char *)(pg) + PGSIZE + ALIGNMENT)
+#define BLOCK_PAGE(bp) ((void *)((char *)(bp) - PGSIZE - ALIGNMENT))
+
+/* Free list links stored in the payload of a free block */
+#define NEXT_FREE(bp) (((free_node *)(bp))->next)
+#define PREV_FREE(bp) (((free_node *)(bp))->prev)
+
+/* Smallest block that can be split off: header, footer and the free list links */
+#define MIN_BLOCK_SIZE ALIGN(2*WSIZE + sizeof(free_node))
+
+/* Empty chunks are retained for reuse up to RETAIN_BUDGET bytes, shared by
+   all the arenas; one that is
+   not reused within RETAIN_DECAY calls to mm_free is unmapped. Override either
+   with -D<name>=<value>. */
+#ifndef RETAIN_BUDGET
+#define RETAIN_BUDGET (256 * 1024)
+#endif
+#ifndef RETAIN_DECAY
+#define RETAIN_DECAY 256
+#endif
+
+/* A free block left in a chunk gives the physical memory of the whole pages
+   inside it back to the system when they add up to at least PURGE_MIN bytes.
+   Override with -DPURGE_MIN=<bytes>. */
+#ifndef PURGE_MIN
+#define PURGE_MIN (64 * 1024)
+#endif
+
+/* When memlib maps huge pages, chunks extended once the heap holds at least
+   HUGE_HEAP_MIN bytes are rounded up to whole huge pages, which memlib also
+   aligns. Override with -DHUGE_HEAP_MIN=<bytes>. */
+#ifndef HUGE_HEAP_MIN
+#define HUGE_HEAP_MIN (8 * 1024 * 1024)
+#endif
+
+/* Free blocks are kept in power-of-two classes starting at 2^MIN_CLASS_SHIFT,
+   each split into 2^SUBCLASS_BITS lists of equal width */
+#define MIN_CLASS_SHIFT 5
+#define SUBCLASS_BITS 2
+#define NUM_CLASSES (40 << SUBCLASS_BITS)
+
+/* Every free block is kept on the lists, where find_fit takes the first
+   block that fits. Build with -DBEST_FIT to keep free blocks of at least
+   TREE_MIN_SIZE bytes in a tree ordered by size and then address instead,
+   from which find_fit takes the best fit. That helps traces with many long
+   lived blocks of scattered sizes but lowers util_i on the default traces,
+   so it is not the default. Override the threshold with -DTREE_MIN_SIZE=<bytes>. */
+#ifndef TREE_MIN_SIZE
+#define TREE_MIN_SIZE 1024
+#endif
+#ifdef BEST_FIT
+#define IN_TREE(size) ((size) >= TREE_MIN_SIZE)
+#else
+#define IN_TREE(size) 0
+#endif
+
+/* Requests of at least LARGE_THRESHOLD bytes get their own mapping instead of
+   a block in a chunk. Override with -DLARGE_THRESHOLD=<bytes>. */
+#ifndef LARGE_THRESHOLD
+#define LARGE_THRESHOLD (128 * 1024)
+#endif
+
+/* Requests of at most SLAB_MAX_SIZE bytes come from page-sized slab runs,
+   one run per SLAB_CLASS_SIZE-byte size class */
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASS_SIZE ALIGNMENT
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_SIZE)
+#define SLAB_CLASS(size) (((size) + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE - 1)
+#define SLAB_OBJ_SIZE(cls) (((cls) + 1) * SLAB_CLASS_SIZE)
+
+/* An arena keeps up to SLAB_KEEP_EMPTY empty runs of each class on its partial
+   list, and up to SLAB_KEEP_SPARE more of any class for slab_new_run to carve
+   again, before it unmaps one. Override either with -D<name>=<runs>. */
+#ifndef SLAB_KEEP_EMPTY
+#define SLAB_KEEP_EMPTY 2
+#endif
+#ifndef SLAB_KEEP_SPARE
+#define SLAB_KEEP_SPARE 8
+#endif
+
+/* A run header is recognized by a magic value mixed with its own address */
+#define SLAB_MAGIC ((size_t)0x5eab5eab5eab5eabULL)
+#define SLAB_RUN(bp) ((slab_run *)ADDRESS_PAGE_START(bp))
+#define SLAB_FIRST_OBJ(run) ((char *)(run) + ALIGN(sizeof(slab_run)))
+#define SLAB_NOBJS(cls) ((mem_pagesize() - ALIGN(sizeof(slab_run))) / SLAB_OBJ_SIZE(cls))
+#define SLAB_BITMAP_WORDS 4
+
+/* Threads are spread over NUM_ARENAS independent heaps, round-robin, or by
+   the CPU they run on when built with -DARENA_BY_CPU. */
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 8
+#endif
+
+/* Each thread caches slab objects per class, taking them from and giving them
+   back to the slab runs TCACHE_BATCH at a time. A bin holds at most
+   TCACHE_BIN_MAX objects and a cache at most TCACHE_MAX_BYTES bytes. Other
+   threads queue at most TCACHE_REMOTE_MAX objects on a cache, as many of the
+   largest class as fit in TCACHE_MAX_BYTES, and free the rest themselves. */
+#ifndef TCACHE_MAX_BYTES
+#define TCACHE_MAX_BYTES (16 * 1024)
+#endif
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH 16
+#endif
+#define TCACHE_BIN_MAX (2 * TCACHE_BATCH)
+#define TCACHE_REMOTE_MAX (TCACHE_MAX_BYTES / SLAB_MAX_SIZE)
+#define MAX_TCACHES 256
+#define NO_OWNER 0xffff   /* run owner of a thread without a cache */
+
+/* A cached object holds its list link and a check word derived from it */
+#define TCACHE_MAGIC ((size_t)0x7cac4e7cac4e7cacULL)
+#define TCACHE_NEXT(bp) (((void **)(bp))[0])
+#define TCACHE_CHECK(bp) (((size_t *)(bp))[1])
+#define TCACHE_SEAL(bp) ((size_t)TCACHE_NEXT(bp) ^ (size_t)(bp) ^ TCACHE_MAGIC)
+
+/* The remote queue of a cache whose thread has exited; a free that finds
+   it there goes to the arena instead */
+#define TCACHE_CLOSED ((void *)1)
+#define TCACHE_REMOTE(tc) ((tc)->remote == TCACHE_CLOSED ? NULL : (tc)->remote)
+
+/* Payload of a large block sits right after its page struct and header */
+#define IS_LARGE(bp) (GET(HDRP(bp)) & LARGE_BIT)
+#define LARGE_PAYLOAD_SIZE(bp) (PAGE_SIZE(BLOCK_PAGE(bp)) - PGSIZE - ALIGNMENT)
 
 
 typedef struct
@@ -58,32 +249,512 @@ typedef struct
   void *next;
   void *prev;
   size_t size;
-  size_t filler;
+  size_t stamp;  //Free count when the chunk entered the retained cache.
 } page;
 
-typedef struct
+typedef struct free_node
 {
-  size_t size;    //In Bytes
-  char allocated; 
-} block_header;
-  
-typedef struct
+  struct free_node *next;
+  struct free_node *prev;
+} free_node;
+
+/* A free block in the tree is an llrb_node; its links, too, live in the payload. */
+typedef llrb_node tree_node;
+
+/* Header at the start of every slab run; a set bitmap bit marks a free object.
+   bitmap_check is the XOR of the bitmap words, kept apart from the bitmap so
+   a single stray write cannot change both consistently. */
+typedef struct slab_run
+{
+  struct slab_run *next;
+  struct slab_run *prev;
+  size_t magic;
+  uint64_t bitmap_check;
+  unsigned short cls;
+  unsigned short nobjs;
+  unsigned short nfree;
+  unsigned short owner;  //Cache of the thread that mapped the run, or NO_OWNER.
+  unsigned short arena;  //Arena whose slab lists hold the run.
+  unsigned short filler[3];
+  uint64_t bitmap[SLAB_BITMAP_WORDS];
+} slab_run;
+
+/* One independent heap; everything in it is guarded by its lock. */
+typedef struct arena
 {
-  size_t size;    //In Bytes
-  char allocated;
-} block_footer;
+  int lock;          //Held by the thread inside the heap_ routines.
+  int id;            //Index in arenas, kept in allocated block headers.
+  page* first_page; //First chunk pointer
+  page* last_page;  //Last chunk pointer, where new chunks are linked in.
+  page* first_large; //Directly mapped large blocks.
+  slab_run* slab_partial[NUM_SLAB_CLASSES]; //Runs with at least one free object.
+  slab_run* slab_full[NUM_SLAB_CLASSES];    //Runs with no free objects.
+  unsigned short slab_empty[NUM_SLAB_CLASSES]; //Partial runs with every object free.
+  slab_run* slab_spare;   //Empty runs taken off their class, to be reused.
+  int slab_spares;
+  free_node* free_lists[NUM_CLASSES]; //Segregated free list heads.
+  tree_node* free_tree;  //Free blocks of at least TREE_MIN_SIZE bytes.
+  int extend_count;
+  page* retained;         //Empty chunks kept for reuse by extend.
+  size_t retained_bytes;  //Total size of the retained chunks.
+  size_t free_calls;      //Calls to mm_free since mm_init, the clock for RETAIN_DECAY.
+  size_t chunks_reused;   //Retained chunks handed back out by extend.
+} __attribute__((aligned(64))) arena;
+
+arena arenas[NUM_ARENAS];
+size_t retained_total;     //Bytes retained by all arenas, held to RETAIN_BUDGET.
+__thread arena *heap;      //The arena whose lock this thread holds.
+__thread arena *my_arena;  //The arena this thread allocates from.
+unsigned next_arena;       //Round-robin counter for my_arena.
+
+/* A thread's cache of slab objects. Only the owning thread touches the bins;
+   other threads push objects they free onto remote, without a lock. */
+typedef struct tcache
+{
+  void *bins[NUM_SLAB_CLASSES];             //Cached objects of each class.
+  unsigned short counts[NUM_SLAB_CLASSES];
+  unsigned short batch[NUM_SLAB_CLASSES];   //Next refill size, doubling to TCACHE_BATCH.
+  unsigned short id;                        //Index in tcaches, the run owner.
+  int alive;                                //A thread is using this cache.
+  size_t bytes;                             //Bytes held in the bins.
+  void *remote;                             //Objects freed by other threads, or TCACHE_CLOSED.
+  size_t remote_count;                      //Objects on remote, or about to be.
+} tcache;
+
+tcache tcaches[MAX_TCACHES]; //Slots are reused once their thread exits.
+int num_tcaches;
+__thread tcache *my_tcache;  //This thread's cache, once it has one.
+pthread_key_t tcache_key;    //Flushes a thread's cache when the thread exits.
+int tcache_key_made;
+int tcache_lock;             //Guards handing out the tcaches slots.
 
-page* first_page; //First chunk pointer
-void* first_pp;   //First payload pointer.
-page* last_page_inserted;
-void* last_block_inserted;
-void* free_next_block;
-int extend_count;
+/*
+ * spin_lock, spin_unlock - a test-and-test-and-set spin lock. A waiter
+ *     yields its CPU, since the holder may be preempted when there are more
+ *     threads than cores.
+ */
+static inline void spin_lock(int *lock)
+{
+  while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+      sched_yield();
+}
+
+static inline void spin_unlock(int *lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * lock_arena, unlock_arena - enter and leave arena a, which becomes the
+ *     heap that the heap_ routines work on.
+ */
+static inline void lock_arena(arena *a)
+{
+  spin_lock(&a->lock);
+  heap = a;
+}
+
+static inline void unlock_arena(void)
+{
+  spin_unlock(&heap->lock);
+}
+
+/*
+ * thread_arena - the arena the calling thread allocates from.
+ */
+static inline arena *thread_arena(void)
+{
+#ifdef ARENA_BY_CPU
+  int cpu = sched_getcpu();
+  return &arenas[cpu < 0 ? 0 : cpu % NUM_ARENAS];
+#else
+  if (my_arena == NULL)
+    my_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+  return my_arena;
+#endif
+}
+
+/*
+ * size_class - index of the free list that holds blocks of the given size.
+ */
+static int size_class(size_t size)
+{
+  int log2 = 63 - __builtin_clzl(size);
+  int c;
+
+  if (log2 < MIN_CLASS_SHIFT)
+    return 0;
+  c = ((log2 - MIN_CLASS_SHIFT) << SUBCLASS_BITS)
+    | ((size >> (log2 - SUBCLASS_BITS)) & ((1 << SUBCLASS_BITS) - 1));
+  return c < NUM_CLASSES ? c : NUM_CLASSES - 1;
+}
+
+/*
+ * The free tree is a left-leaning red-black tree (llrb.h) keyed by a
+ *     block's size and then its address. tree_less tells whether the
+ *     block bp of the given size sorts before node h.
+ */
+static inline int tree_less(void *bp, size_t size, tree_node *h)
+{
+  size_t h_size = GET_SIZE(HDRP(h));
+
+  return size < h_size || (size == h_size && (char *)bp < (char *)h);
+}
+
+static int tree_cmp(const llrb_node *a, const llrb_node *b)
+{
+  return tree_less((void *)a, GET_SIZE(HDRP(a)), (tree_node *)b) ? -1 : a != b;
+}
+
+/*
+ * tree_fit - the smallest free block in the tree of at least size bytes,
+ *     the lowest addressed one among equals; NULL if there is none.
+ */
+static void *tree_fit(size_t size)
+{
+  tree_node *h = heap->free_tree, *best = NULL;
+
+  while (h != NULL)
+    if (GET_SIZE(HDRP(h)) >= size)
+      {
+	best = h;
+	h = h->left;
+      }
+    else
+      h = h->right;
+  return best;
+}
+
+static void insert_free(void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+  free_node **head = &heap->free_lists[size_class(size)];
+
+  if (IN_TREE(size))
+    {
+      llrb_insert(&heap->free_tree, bp, tree_cmp);
+      return;
+    }
+
+  NEXT_FREE(bp) = *head;
+  PREV_FREE(bp) = NULL;
+  if (*head != NULL)
+    PREV_FREE(*head) = bp;
+  *head = bp;
+}
+
+static void remove_free(void *bp)
+{
+  size_t size = GET_SIZE(HDRP(bp));
+
+  if (IN_TREE(size))
+    {
+      llrb_remove(&heap->free_tree, bp, tree_cmp);
+      return;
+    }
+
+  if (PREV_FREE(bp) != NULL)
+    NEXT_FREE(PREV_FREE(bp)) = NEXT_FREE(bp);
+  else
+    heap->free_lists[size_class(size)] = NEXT_FREE(bp);
+
+  if (NEXT_FREE(bp) != NULL)
+    PREV_FREE(NEXT_FREE(bp)) = PREV_FREE(bp);
+}
+
+/*
+ * link_page - add a freshly mapped chunk at the tail of the chunk list.
+ */
+static void link_page(void *pg)
+{
+  NEXT_PAGE(pg) = NULL;
+  PREV_PAGE(pg) = heap->last_page;
+  if (heap->last_page != NULL)
+    NEXT_PAGE(heap->last_page) = pg;
+  else
+    heap->first_page = pg;
+  heap->last_page = pg;
+}
+
+/*
+ * unlink_page - remove a chunk from the chunk list through its own links.
+ */
+static void unlink_page(void *pg)
+{
+  if (PREV_PAGE(pg) != NULL)
+    NEXT_PAGE(PREV_PAGE(pg)) = NEXT_PAGE(pg);
+  else
+    heap->first_page = NEXT_PAGE(pg);
+
+  if (NEXT_PAGE(pg) != NULL)
+    PREV_PAGE(NEXT_PAGE(pg)) = PREV_PAGE(pg);
+  else
+    heap->last_page = PREV_PAGE(pg);
+}
+
+/*
+ * retain_page - keep an empty chunk, already off the chunk list, for reuse.
+ */
+static void retain_page(void *pg)
+{
+  PAGE_STAMP(pg) = heap->free_calls;
+  PREV_PAGE(pg) = NULL;
+  NEXT_PAGE(pg) = heap->retained;
+  if (heap->retained != NULL)
+    PREV_PAGE(heap->retained) = pg;
+  heap->retained = pg;
+  heap->retained_bytes += PAGE_SIZE(pg);
+}
+
+static void unretain_page(void *pg)
+{
+  if (PREV_PAGE(pg) != NULL)
+    NEXT_PAGE(PREV_PAGE(pg)) = NEXT_PAGE(pg);
+  else
+    heap->retained = NEXT_PAGE(pg);
+  if (NEXT_PAGE(pg) != NULL)
+    PREV_PAGE(NEXT_PAGE(pg)) = PREV_PAGE(pg);
+  heap->retained_bytes -= PAGE_SIZE(pg);
+  __atomic_fetch_sub(&retained_total, PAGE_SIZE(pg), __ATOMIC_RELAXED);
+}
+
+/*
+ * decay_retained - unmap retained chunks that have gone RETAIN_DECAY frees
+ *     without being reused. Newer chunks sit at the head of the list.
+ */
+static void decay_retained(void)
+{
+  void *pg = heap->retained, *next;
+
+  while (pg != NULL)
+    {
+      next = NEXT_PAGE(pg);
+      if (heap->free_calls - PAGE_STAMP(pg) > RETAIN_DECAY)
+	{
+	  unretain_page(pg);
+	  mem_unmap(pg, PAGE_SIZE(pg));
+	}
+      pg = next;
+    }
+}
+
+/*
+ * large_malloc - map a region of its own for a large request. The region
+ *     starts with a page struct linking it into the large block list,
+ *     followed by a header with LARGE_BIT set. NULL if it cannot be mapped.
+ */
+static void *large_malloc(size_t size)
+{
+  size_t region_size = PAGE_ALIGN(size + PGSIZE + ALIGNMENT);
+  void *region = mem_map(region_size);
+  void *bp;
+
+  if (region == NULL)
+    return NULL;
+  bp = FIRST_BLKP(region);
+  PAGE_SIZE(region) = region_size;
+  PREV_PAGE(region) = NULL;
+  NEXT_PAGE(region) = heap->first_large;
+  if (heap->first_large != NULL)
+    PREV_PAGE(heap->first_large) = region;
+  heap->first_large = region;
+
+  PUT(HDRP(bp), PACK(region_size, LARGE_BIT | ALLOC_BIT | ARENA_TAG(heap)));
+  return bp;
+}
+
+static void large_free(void *bp)
+{
+  void *region = BLOCK_PAGE(bp);
+
+  if (PREV_PAGE(region) != NULL)
+    NEXT_PAGE(PREV_PAGE(region)) = NEXT_PAGE(region);
+  else
+    heap->first_large = NEXT_PAGE(region);
+  if (NEXT_PAGE(region) != NULL)
+    PREV_PAGE(NEXT_PAGE(region)) = PREV_PAGE(region);
+
+  mem_unmap(region, PAGE_SIZE(region));
+}
+
+static void slab_push(slab_run **head, slab_run *run)
+{
+  run->prev = NULL;
+  run->next = *head;
+  if (*head != NULL)
+    (*head)->prev = run;
+  *head = run;
+}
+
+static void slab_unlink(slab_run **head, slab_run *run)
+{
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    *head = run->next;
+  if (run->next != NULL)
+    run->next->prev = run->prev;
+}
+
+/*
+ * slab_new_run - take a spare run, or map a page, and carve it into objects
+ *     of class cls, all free; NULL if the page cannot be mapped.
+ */
+static slab_run *slab_new_run(int cls)
+{
+  slab_run *run = heap->slab_spare;
+  size_t i;
+
+  if (run != NULL)
+    {
+      slab_unlink(&heap->slab_spare, run);
+      heap->slab_spares--;
+    }
+  else if ((run = mem_map(mem_pagesize())) == NULL)
+    return NULL;
+
+  run->magic = SLAB_MAGIC ^ (size_t)run;
+  run->cls = cls;
+  run->nobjs = SLAB_NOBJS(cls);
+  run->nfree = run->nobjs;
+  run->owner = my_tcache != NULL ? my_tcache->id : NO_OWNER;
+  run->arena = heap->id;
+  run->bitmap_check = 0;
+  for (i = 0; i < SLAB_BITMAP_WORDS; i++)
+    {
+      if (run->nobjs >= (i + 1) * 64)
+	run->bitmap[i] = ~(uint64_t)0;
+      else if (run->nobjs > i * 64)
+	run->bitmap[i] = ((uint64_t)1 << (run->nobjs - i * 64)) - 1;
+      else
+	run->bitmap[i] = 0;
+      run->bitmap_check ^= run->bitmap[i];
+    }
+
+  slab_push(&heap->slab_partial[cls], run);
+  heap->slab_empty[cls]++;
+  return run;
+}
+
+/*
+ * slab_malloc - take the first free object of the first partial run.
+ */
+static void *slab_malloc(size_t size)
+{
+  int cls = SLAB_CLASS(size);
+  slab_run *run = heap->slab_partial[cls];
+  int i, bit;
+
+  if (run == NULL && (run = slab_new_run(cls)) == NULL)
+    return NULL;
+  if (run->nfree == run->nobjs)
+    heap->slab_empty[cls]--;
+
+  for (i = 0; run->bitmap[i] == 0; i++)
+    ;
+  bit = __builtin_ctzll(run->bitmap[i]);
+  run->bitmap[i] &= ~((uint64_t)1 << bit);
+  run->bitmap_check ^= (uint64_t)1 << bit;
+
+  if (--run->nfree == 0)
+    {
+      slab_unlink(&heap->slab_partial[cls], run);
+      slab_push(&heap->slab_full[cls], run);
+    }
+
+  return SLAB_FIRST_OBJ(run) + (size_t)(i * 64 + bit) * SLAB_OBJ_SIZE(cls);
+}
+
+/*
+ * slab_free - set the object's bit again; a run that becomes empty stays
+ *     with its class, becomes a spare or, once both are full, is unmapped.
+ */
+static void slab_free(void *bp)
+{
+  slab_run *run = SLAB_RUN(bp);
+  size_t idx = ((char *)bp - SLAB_FIRST_OBJ(run)) / SLAB_OBJ_SIZE(run->cls);
+
+  run->bitmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+  run->bitmap_check ^= (uint64_t)1 << (idx % 64);
+
+  if (run->nfree++ == 0)
+    {
+      slab_unlink(&heap->slab_full[run->cls], run);
+      slab_push(&heap->slab_partial[run->cls], run);
+    }
+
+  if (run->nfree == run->nobjs)
+    {
+      if (heap->slab_empty[run->cls] < SLAB_KEEP_EMPTY)
+	heap->slab_empty[run->cls]++;
+      else
+	{
+	  slab_unlink(&heap->slab_partial[run->cls], run);
+	  if (heap->slab_spares < SLAB_KEEP_SPARE)
+	    {
+	      slab_push(&heap->slab_spare, run);
+	      heap->slab_spares++;
+	    }
+	  else
+	    mem_unmap(run, mem_pagesize());
+	}
+    }
+}
+
+/*
+ * is_slab_object - whether bp lies in a slab run, judged by the run header
+ *     at the start of bp's page.
+ */
+static int is_slab_object(void *bp)
+{
+  slab_run *run = SLAB_RUN(bp);
+
+  //For a chunk block this word may belong to a block another thread is
+  //changing under an arena lock; it can never hold a run's magic, though.
+  return __atomic_load_n(&run->magic, __ATOMIC_RELAXED) == (SLAB_MAGIC ^ (size_t)run);
+}
+
+/*
+ * block_arena - the arena that owns the allocated block or slab object bp.
+ *     The word read may share a header with bits another thread changes
+ *     under the same arena's lock, but never the arena bits themselves.
+ */
+static inline arena *block_arena(void *bp)
+{
+  if (is_slab_object(bp))
+    return &arenas[SLAB_RUN(bp)->arena];
+  return &arenas[__atomic_load_n((size_t *)HDRP(bp), __ATOMIC_RELAXED) >> ARENA_SHIFT];
+}
+
+/*
+ * find_fit - the best fit from the tree for a size it holds. Otherwise first
+ *     fit within the block's own size class, then the head of any larger
+ *     class (every block there is big enough), then the best fit in the tree.
+ */
+static void *find_fit(size_t size)
+{
+  int c = size_class(size);
+  free_node *bp;
+
+  if (IN_TREE(size))
+    return tree_fit(size);
+
+  for (bp = heap->free_lists[c]; bp != NULL; bp = bp->next)
+    if (GET_SIZE(HDRP(bp)) >= size)
+      return bp;
+
+  for (c = c + 1; c < NUM_CLASSES; c++)
+    if (heap->free_lists[c] != NULL)
+      return heap->free_lists[c];
+
+  return tree_fit(size);
+}
 
 
 void examinePages()
 {
-  void* pg = first_page;
+  void* pg = heap->first_page;
   while(pg != NULL)
   {
     printf("[prev:%p| %p |next:%p]\n",PREV_PAGE(pg), pg, NEXT_PAGE(pg));
@@ -93,36 +764,31 @@ void examinePages()
 
 void examinePage(void* page)
 {
-  void* pg = page;
-  void* pp;
-  while(pg != NULL)
+  void* pp = FIRST_BLKP(page);
+
+  while(GET_SIZE(HDRP(pp)) != 0)
     {
-      pp = (void *)pg + PGSIZE + BHSIZE;
-      
-      while(GET_SIZE(HDRP(pp)) != 0)
-        {
-          printf("[%ld,%d]=[%ld]--> ", GET_SIZE(HDRP(pp))/sizeof(block_header), GET_ALLOC(HDRP(pp)), GET_SIZE(FTRP(pp))/sizeof(block_header));
-          pp = NEXT_BLKP(pp);
-        }
-      printf("[X]\n");
+      printf("[%ld,%ld]--> ", GET_SIZE(HDRP(pp))/ALIGNMENT, GET_ALLOC(HDRP(pp)));
+      pp = NEXT_BLKP(pp);
     }
+  printf("[X]\n");
 }
 
 void examineMemory()
 {
-  void* pp = first_pp;
-  void* pg = first_page;
+  void* pp;
+  void* pg = heap->first_page;
 
   int pageCount = 0;
 
   while(pg != NULL)
     {
-      pp = (void *)pg + PGSIZE + BHSIZE;
+      pp = FIRST_BLKP(pg);
       printf("[pg : %d]\n", pageCount);
       
       while(GET_SIZE(HDRP(pp)) != 0)
         {
-          printf("[%ld,%d]=[%ld]--> ", GET_SIZE(HDRP(pp))/sizeof(block_header), GET_ALLOC(HDRP(pp)), GET_SIZE(FTRP(pp))/sizeof(block_header));
+          printf("[%ld,%ld]--> ", GET_SIZE(HDRP(pp))/ALIGNMENT, GET_ALLOC(HDRP(pp)));
           pp = NEXT_BLKP(pp);
         }
       printf("[X]\n");
@@ -131,45 +797,57 @@ void examineMemory()
       pageCount++;
     }
 }
+/*
+ * init_chunk - link a freshly mapped chunk into the chunk list and lay out
+ *     one free block spanning it, followed by the terminator header.
+ *     Returns the free block, which is not on a free list yet.
+ */
+static void *init_chunk(void *pg, size_t chunk_size)
+{
+  void *pp = FIRST_BLKP(pg);
+
+  link_page(pg);
+  PAGE_SIZE(pg) = chunk_size;
+
+  //Nothing precedes the first block, so it never coalesces backwards.
+  PUT(HDRP(pp), PACK(chunk_size - PGSIZE - ALIGNMENT, PREV_ALLOC_BIT | FIRST_BIT));
+  PUT(FTRP(pp), PACK(chunk_size - PGSIZE - ALIGNMENT, 0));
+
+  //Terminator header in the last word of the chunk.
+  PUT(HDRP(NEXT_BLKP(pp)), PACK(0, ALLOC_BIT));
+
+  return pp;
+}
+
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-  extend_count = 0;
-
   size_t firstPageSize = PAGE_ALIGN(mem_pagesize() * 8);
-  first_page = mem_map(firstPageSize);
-  last_page_inserted = first_page;
-  
-  //First Page Setup
-  NEXT_PAGE(first_page) = NULL;
-  PREV_PAGE(first_page) = NULL;
-  PAGE_SIZE(first_page) = firstPageSize;
-
-  //First payload pointer
-  first_pp = (char *)first_page + PGSIZE + BHSIZE;
-  last_block_inserted = first_pp;
-
-  void* pp = first_pp;
-  //Setup Coalescing Prologue.
-  GET_SIZE(HDRP(pp)) = OVERHEAD;
-  GET_ALLOC(HDRP(pp)) = 1;
-  GET_SIZE(FTRP(pp)) = OVERHEAD;
-  GET_ALLOC(FTRP(pp)) = 1;
-
-  pp = NEXT_BLKP(pp);
-  //setup unallocated block for new chunk.
-  GET_SIZE(HDRP(pp)) = firstPageSize - PGSIZE -  OVERHEAD - BHSIZE;
-  GET_ALLOC(HDRP(pp)) = 0;
-  GET_SIZE(FTRP(pp)) = firstPageSize - PGSIZE -  OVERHEAD - BHSIZE;
-  GET_ALLOC(FTRP(pp)) = 0;
-
-  pp = NEXT_BLKP(pp);
-  //setup terminator block for new chunk
-  GET_SIZE(HDRP(pp)) = 0;
-  GET_ALLOC(HDRP(pp)) = 1;
+  void *pg;
 
+  //Every arena starts empty; all but the first map a chunk on first use.
+  memset(arenas, 0, sizeof(arenas));
+  for (int i = 0; i < NUM_ARENAS; i++)
+    arenas[i].id = i;
+  retained_total = 0;
+
+  //Cached objects belonged to the old heap.
+  for (int i = 0; i < num_tcaches; i++)
+    {
+      memset(tcaches[i].bins, 0, sizeof(tcaches[i].bins));
+      memset(tcaches[i].counts, 0, sizeof(tcaches[i].counts));
+      memset(tcaches[i].batch, 0, sizeof(tcaches[i].batch));
+      tcaches[i].bytes = 0;
+      tcaches[i].remote = tcaches[i].alive ? NULL : TCACHE_CLOSED;
+      tcaches[i].remote_count = 0;
+    }
+
+  heap = &arenas[0];
+  if ((pg = mem_map(firstPageSize)) == NULL)
+    return -1;
+  insert_free(init_chunk(pg, firstPageSize));
 
   // printf("\n");
   // printf("\n");
@@ -180,128 +858,100 @@ int mm_init(void)
 
 void* extend(size_t new_size) 
 {
- int pgsz_mult = 8 * (extend_count/8) < 1 ? 1 : (extend_count/8);
- extend_count += 1;
+ void *pg;
+
+ //Reuse a retained chunk whose free block is big enough.
+ for (pg = heap->retained; pg != NULL; pg = NEXT_PAGE(pg))
+   if (PAGE_SIZE(pg) - PGSIZE - ALIGNMENT >= new_size)
+     {
+       unretain_page(pg);
+       heap->chunks_reused++;
+       return init_chunk(pg, PAGE_SIZE(pg));
+     }
+
+ int pgsz_mult = 8 * (heap->extend_count/8) < 1 ? 1 : (heap->extend_count/8);
+ heap->extend_count += 1;
  //printf("ec:%d\n",extend_count);
 
  int clampedSize = new_size > (pgsz_mult * mem_pagesize()) ? new_size : pgsz_mult * mem_pagesize();
  size_t chunk_size = PAGE_ALIGN(clampedSize * 8); //PAGE_ALIGN(clampedSize * 4);
- void *new_page = mem_map(chunk_size);
-
- //Find pageList end.
- void *pg = first_page;
- while(NEXT_PAGE(pg) != NULL)
- {
-  pg = NEXT_PAGE(pg);
- }
-
- //Hookup new page into pageList.
- NEXT_PAGE(pg) = new_page;
- NEXT_PAGE(NEXT_PAGE(pg)) = NULL;
- PREV_PAGE(NEXT_PAGE(pg)) = pg;
- PAGE_SIZE(NEXT_PAGE(pg)) = chunk_size;
-
- last_page_inserted = NEXT_PAGE(pg);
-
- void *pp = new_page + PGSIZE + BHSIZE;
-
- last_block_inserted = pp;
 
- //create prologue for new page
- GET_SIZE(HDRP(pp)) = OVERHEAD;
- GET_ALLOC(HDRP(pp)) = 1;
- GET_SIZE(FTRP(pp)) = OVERHEAD;
- GET_ALLOC(FTRP(pp)) = 1;
+ //A large heap is better served by a few TLB entries per chunk.
+ size_t hpage = mem_hugepagesize();
+ if (hpage != 0 && mem_heapsize() >= HUGE_HEAP_MIN)
+   chunk_size = (chunk_size + hpage - 1) & ~(hpage - 1);
 
- pp = NEXT_BLKP(pp); 
- //create unalocated block
- GET_SIZE(HDRP(pp)) = chunk_size - PGSIZE - OVERHEAD - BHSIZE;
- GET_SIZE(FTRP(pp)) = chunk_size - PGSIZE - OVERHEAD - BHSIZE;
- GET_ALLOC(HDRP(pp)) = 0;
- GET_ALLOC(FTRP(pp)) = 0;
-
- pp = NEXT_BLKP(pp);
- //create terminator block
- GET_SIZE(HDRP(pp)) = 0;
- GET_ALLOC(HDRP(pp)) = 1;
-
- return (new_page + PGSIZE + OVERHEAD + BHSIZE);
+ //Hookup new page at the tail of the pageList.
+ pg = mem_map(chunk_size);
+ if (pg == NULL)
+   return NULL;
+ return init_chunk(pg, chunk_size);
 }
 
+/*
+ * set_allocated - allocate size bytes at the start of the free block bp,
+ *     which is already off its free list, splitting off any usable tail.
+ */
 void set_allocated(void *bp, size_t size) 
 {
- size_t extra_size = GET_SIZE(HDRP(bp)) - size;
+ size_t cur_size = GET_SIZE(HDRP(bp));
+ size_t flags = GET(HDRP(bp)) & (PREV_ALLOC_BIT | FIRST_BIT);
+ size_t purged = GET(HDRP(bp)) & PURGED_BIT;
 
- if (extra_size > ALIGN(1 + OVERHEAD)) 
+ if (cur_size - size >= MIN_BLOCK_SIZE) 
  {
-   GET_SIZE(HDRP(bp)) = size;
-   GET_SIZE(FTRP(bp)) = size;
+   PUT(HDRP(bp), PACK(size, flags | ALLOC_BIT | ARENA_TAG(heap)));
 
-   GET_SIZE(HDRP(NEXT_BLKP(bp))) = extra_size;
-   GET_SIZE(FTRP(NEXT_BLKP(bp))) = extra_size;
-
-   GET_ALLOC(HDRP(NEXT_BLKP(bp))) = 0;
-   GET_ALLOC(FTRP(NEXT_BLKP(bp))) = 0;
+   //The tail's whole pages lie within bp's, so a purged block leaves a purged tail.
+   PUT(HDRP(NEXT_BLKP(bp)), PACK(cur_size - size, PREV_ALLOC_BIT | purged));
+   PUT(FTRP(NEXT_BLKP(bp)), PACK(cur_size - size, 0));
+   insert_free(NEXT_BLKP(bp));
+ }
+ else
+ {
+   PUT(HDRP(bp), PACK(cur_size, flags | ALLOC_BIT | ARENA_TAG(heap)));
+   SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
  }
- GET_ALLOC(HDRP(bp)) = 1;
- GET_ALLOC(FTRP(bp)) = 1;
 }
 
 /* 
- * mm_malloc - Allocate a block by using bytes from current_avail,
- *     grabbing a new page if necessary.
+ * heap_malloc - Allocate a block from the segregated free lists,
+ *     grabbing a new chunk if necessary; NULL if none can be mapped.
+ *     The caller holds the lock of the arena in heap.
  */
-void *mm_malloc(size_t size) 
+static void *heap_malloc(size_t size) 
 {
   if(size == 0)
     return NULL;
+  if(size <= SLAB_MAX_SIZE)
+    return slab_malloc(size);
+  if(size >= LARGE_THRESHOLD)
+    return large_malloc(size);
   
- int new_size = ALIGN(size + OVERHEAD);
- void *pg = first_page;
+ size_t new_size = ALIGN(size + WSIZE);
  void *pp;
- 
- pg = last_page_inserted == NULL ? first_page : last_page_inserted;
- pp = pg + PGSIZE + OVERHEAD + BHSIZE;
-
-
- while (GET_SIZE(HDRP(pp)) != 0)
-   {
-     if (!GET_ALLOC(HDRP(pp)) && (GET_SIZE(HDRP(pp)) >= new_size))
-       {
-	 set_allocated(pp, new_size);
-	 return pp;
-       }
-     pp = NEXT_BLKP(pp);
-   }
 
- pg = first_page;
- while(pg != NULL)
- {
-   //if(pg != last_page_inserted)
-    {
-     pp = pg + PGSIZE + OVERHEAD + BHSIZE;
-     while (GET_SIZE(HDRP(pp)) != 0)
-     {
-      if (!GET_ALLOC(HDRP(pp)) && (GET_SIZE(HDRP(pp)) >= new_size))
-      {
-        set_allocated(pp, new_size);
-        last_page_inserted = pg;
-        return pp;
-      }
-      pp = NEXT_BLKP(pp);
-     }
-    } 
-    pg = NEXT_PAGE(pg);
-  }   
- 
- pp = extend(new_size);
+ if (new_size < MIN_BLOCK_SIZE)
+   new_size = MIN_BLOCK_SIZE;
+
+ pp = find_fit(new_size);
+ if (pp != NULL)
+   remove_free(pp);
+ else if ((pp = extend(new_size)) == NULL)
+   return NULL;
+
  set_allocated(pp, new_size);
  return pp;
 }
 
+/*
+ * coalesce - merge the free block bp with its free neighbors and put the
+ *     result on its free list. bp's header, footer and the next block's
+ *     previous-allocated bit must already describe it as free.
+ */
 void *coalesce(void *bp)
 {
- size_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
+ size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
  size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
  size_t size = GET_SIZE(HDRP(bp));
 
@@ -311,83 +961,521 @@ void *coalesce(void *bp)
    }
  else if (prev_alloc && !next_alloc)
    { /* Case 2 */
+     remove_free(NEXT_BLKP(bp));
      size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-     GET_SIZE(HDRP(bp)) = size;
-     GET_SIZE(FTRP(bp)) = size;
    }
  else if (!prev_alloc && next_alloc)
    { /* Case 3 */
+     remove_free(PREV_BLKP(bp));
      size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-     GET_SIZE(FTRP(bp)) = size;
-     GET_SIZE(HDRP(PREV_BLKP(bp))) = size;
      bp = PREV_BLKP(bp);
    }
  else
    { /* Case 4 */
+     remove_free(PREV_BLKP(bp));
+     remove_free(NEXT_BLKP(bp));
      size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp))));
-     GET_SIZE(HDRP(PREV_BLKP(bp))) = size;
-     GET_SIZE(FTRP(NEXT_BLKP(bp))) = size;
      bp = PREV_BLKP(bp);
    }
 
+ //The merged block keeps the flags of its first block.
+ PUT(HDRP(bp), PACK(size, GET(HDRP(bp)) & (PREV_ALLOC_BIT | FIRST_BIT)));
+ PUT(FTRP(bp), PACK(size, 0));
+
+ insert_free(bp);
  return bp;
 }
 
-void attempt_unmap(void *ptr)
+/*
+ * attempt_unmap - retain or unmap the chunk of free block ptr if ptr is all
+ *     that is left of it. Returns 1 if the chunk was unmapped.
+ */
+int attempt_unmap(void *ptr)
 {
-  void *prev = HDRP(PREV_BLKP(ptr));
-  void *next = HDRP(NEXT_BLKP(ptr));
-
-  size_t unmap_size = PAGE_ALIGN(GET_SIZE(HDRP(ptr)) + OVERHEAD + BHSIZE + PGSIZE);
-  void * page_start = ptr - OVERHEAD - BHSIZE - PGSIZE;
-  //printf("unmap_size :%ld\n",unmap_size);
+  void *page_start = BLOCK_PAGE(ptr);
   
-  //Terminator block is next. Prologue block is prev.
-  if(GET_SIZE(next) == 0 && GET_SIZE(prev) == OVERHEAD)
+  //First block of its chunk and the terminator is next.
+  if((GET(HDRP(ptr)) & FIRST_BIT) && GET_SIZE(HDRP(NEXT_BLKP(ptr))) == 0)
   {
-    //Un hook page from page linked list.
-    void *pg = first_page;
-    while(pg != page_start)
+    //Keep the last remaining chunk around.
+    if(heap->first_page == heap->last_page)
+      return 0;
+
+    unlink_page(page_start);
+    remove_free(ptr);
+
+    //The budget is shared with arenas locked by other threads.
+    decay_retained();
+    if(__atomic_add_fetch(&retained_total, PAGE_SIZE(page_start), __ATOMIC_RELAXED) <= RETAIN_BUDGET)
+      retain_page(page_start);
+    else
+      {
+	__atomic_fetch_sub(&retained_total, PAGE_SIZE(page_start), __ATOMIC_RELAXED);
+	mem_unmap(page_start, PAGE_SIZE(page_start));
+	return 1;
+      }
+  }
+  return 0;
+}
+
+/*
+ * dirty_span - the part of the free block bp and its free neighbors, about
+ *     to be coalesced, whose pages may still be dirty: all of bp, and all
+ *     of each neighbor except the whole pages of one marked PURGED_BIT.
+ */
+static void dirty_span(void *bp, void **start, void **end)
+{
+  void *next = NEXT_BLKP(bp);
+
+  *start = bp;
+  if(!GET_PREV_ALLOC(HDRP(bp)))
+    *start = (GET(HDRP(PREV_BLKP(bp))) & PURGED_BIT) ? (void *)FTRP(PREV_BLKP(bp)) : PREV_BLKP(bp);
+  *end = next;
+  if(!GET_ALLOC(HDRP(next)))
+    *end = (GET(HDRP(next)) & PURGED_BIT) ? (char *)next + sizeof(tree_node) : NEXT_BLKP(next);
+}
+
+/*
+ * purge_free - give back the physical memory of the whole pages between
+ *     free block bp's links (list or tree, whichever is longer) and its
+ *     footer, which stay mapped, if they add up to PURGE_MIN bytes, and
+ *     mark bp PURGED_BIT. Only the pages that overlap the dirty span
+ *     [start, end) are handed to mem_purge; the rest already were.
+ */
+static void purge_free(void *bp, void *start, void *end)
+{
+  uintptr_t lo = PAGE_ALIGN((uintptr_t)bp + sizeof(tree_node));
+  uintptr_t hi = (uintptr_t)FTRP(bp) & ~(uintptr_t)(mem_pagesize() - 1);
+  uintptr_t span_lo = (uintptr_t)ADDRESS_PAGE_START(start);
+  uintptr_t span_hi = PAGE_ALIGN((uintptr_t)end);
+
+  if(hi <= lo || hi - lo < PURGE_MIN)
+    return;
+  if(span_lo > lo)
+    lo = span_lo;
+  if(span_hi < hi)
+    hi = span_hi;
+  if(hi > lo)
+    mem_purge((void *)lo, hi - lo);
+  GET(HDRP(bp)) |= PURGED_BIT;
+}
+
+/*
+ * mark_free - write the header and footer of bp as a free block of size
+ *     bytes and tell the next block that its predecessor is free.
+ */
+static void mark_free(void *bp, size_t size)
+{
+  PUT(HDRP(bp), PACK(size, GET(HDRP(bp)) & (PREV_ALLOC_BIT | FIRST_BIT)));
+  PUT(FTRP(bp), PACK(size, 0));
+  CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+}
+
+/*
+ * heap_free - Mark the block free, coalesce it and give its chunk back
+ *     if the chunk is now empty. The caller holds the lock of the arena in heap.
+ */
+static void heap_free(void *ptr)
+{
+  void *start, *end;
+
+  heap->free_calls++;
+  if(is_slab_object(ptr))
+  {
+    slab_free(ptr);
+    return;
+  }
+  if(IS_LARGE(ptr))
+  {
+    large_free(ptr);
+    return;
+  }
+  mark_free(ptr, GET_SIZE(HDRP(ptr)));
+  dirty_span(ptr, &start, &end);
+  ptr = coalesce(ptr);
+  if(!attempt_unmap(ptr))
+    purge_free(ptr, start, end);
+}
+
+/*
+ * heap_realloc - Resize the block in place when it shrinks or when the block
+ *     after it is free and big enough; otherwise allocate, copy and free.
+ *     If the allocation fails, ptr is left alone and NULL is returned.
+ *     The caller holds the lock of the block's arena.
+ */
+static void *heap_realloc(void *ptr, size_t size)
+{
+  size_t new_size, cur_size, next_size;
+  void *newp, *start, *end;
+
+  if (ptr == NULL)
+    return heap_malloc(size);
+  if (size == 0)
     {
-      pg = NEXT_PAGE(pg);
+      heap_free(ptr);
+      return NULL;
     }
 
-    //page to remove is page linked list head
-    if(pg == first_page)
+  if (is_slab_object(ptr))
     {
-      //About to remove first page.
-      if(NEXT_PAGE(first_page) == NULL && PREV_PAGE(first_page) == NULL)
-        return;
+      //A slab object stays put while the request still maps to its class.
+      cur_size = SLAB_OBJ_SIZE(SLAB_RUN(ptr)->cls);
+      if (size <= cur_size && SLAB_CLASS(size) == SLAB_RUN(ptr)->cls)
+	return ptr;
+      if ((newp = heap_malloc(size)) == NULL)
+	return NULL;
+      memcpy(newp, ptr, size < cur_size ? size : cur_size);
+      heap_free(ptr);
+      return newp;
+    }
 
-      PREV_PAGE(NEXT_PAGE(first_page)) = NULL;
-      first_page = last_page_inserted =  NEXT_PAGE(first_page);
+  if (IS_LARGE(ptr))
+    {
+      //A large block stays in its mapping as long as it fits and is still large.
+      cur_size = LARGE_PAYLOAD_SIZE(ptr);
+      if (size >= LARGE_THRESHOLD && size <= cur_size)
+	return ptr;
+      if ((newp = heap_malloc(size)) == NULL)
+	return NULL;
+      memcpy(newp, ptr, size < cur_size ? size : cur_size);
+      heap_free(ptr);
+      return newp;
     }
-    else if(NEXT_PAGE(pg) != NULL && PREV_PAGE(pg) != NULL)
+
+  new_size = ALIGN(size + WSIZE);
+  if (new_size < MIN_BLOCK_SIZE)
+    new_size = MIN_BLOCK_SIZE;
+  cur_size = GET_SIZE(HDRP(ptr));
+
+  if (size >= LARGE_THRESHOLD)
     {
-      PREV_PAGE(NEXT_PAGE(pg)) = PREV_PAGE(pg);
-      NEXT_PAGE(PREV_PAGE(pg)) = NEXT_PAGE(pg);
+      if ((newp = large_malloc(size)) == NULL)
+	return NULL;
+      memcpy(newp, ptr, cur_size - WSIZE);
+      heap_free(ptr);
+      return newp;
     }
-    else
+
+  if (new_size <= cur_size)
     {
-      NEXT_PAGE(PREV_PAGE(pg)) = NULL;
+      //Shrink in place, handing any tail back to the free lists.
+      if (cur_size - new_size >= MIN_BLOCK_SIZE)
+	{
+	  PUT(HDRP(ptr), PACK(new_size, GET(HDRP(ptr)) & (FLAG_BITS | ARENA_BITS)));
+
+	  newp = NEXT_BLKP(ptr);
+	  PUT(HDRP(newp), PACK(cur_size - new_size, PREV_ALLOC_BIT));
+	  mark_free(newp, cur_size - new_size);
+	  dirty_span(newp, &start, &end);
+	  purge_free(coalesce(newp), start, end);
+	}
+      return ptr;
     }
 
-    last_page_inserted = NULL;
-    last_block_inserted = NULL;
-    
-    mem_unmap(page_start,unmap_size);
-  }
+  //Grow into the free block after this one, which may be the chunk's trailing free space.
+  newp = NEXT_BLKP(ptr);
+  next_size = GET_SIZE(HDRP(newp));
+  if (!GET_ALLOC(HDRP(newp)) && cur_size + next_size >= new_size)
+    {
+      remove_free(newp);
+      PUT(HDRP(ptr), PACK(cur_size + next_size, GET(HDRP(ptr)) & (FLAG_BITS | ARENA_BITS)));
+      set_allocated(ptr, new_size);
+      return ptr;
+    }
+
+  if ((newp = heap_malloc(size)) == NULL)
+    return NULL;
+  memcpy(newp, ptr, cur_size - WSIZE);
+  heap_free(ptr);
+  return newp;
+}
+
+/*
+ * tcache_push - put a slab object of class cls into tc's bin.
+ */
+static inline void tcache_push(tcache *tc, void *bp, int cls)
+{
+  TCACHE_NEXT(bp) = tc->bins[cls];
+  TCACHE_CHECK(bp) = TCACHE_SEAL(bp);
+  tc->bins[cls] = bp;
+  tc->counts[cls]++;
+  tc->bytes += SLAB_OBJ_SIZE(cls);
+}
+
+static inline void *tcache_pop(tcache *tc, int cls)
+{
+  void *bp = tc->bins[cls];
+
+  tc->bins[cls] = TCACHE_NEXT(bp);
+  tc->counts[cls]--;
+  tc->bytes -= SLAB_OBJ_SIZE(cls);
+  return bp;
+}
+
+/*
+ * tcache_flush - give up to n objects of tc's bin cls back to their runs
+ *     holding the lock of each arena involved once per run of objects.
+ */
+static void tcache_flush(tcache *tc, int cls, int n)
+{
+  arena *a = NULL, *next;
+  void *bp;
+
+  //Objects go back to the arena of their run, which may differ between them.
+  while (n-- > 0 && tc->bins[cls] != NULL)
+    {
+      bp = tcache_pop(tc, cls);
+      next = &arenas[SLAB_RUN(bp)->arena];
+      if (next != a)
+	{
+	  if (a != NULL)
+	    unlock_arena();
+	  lock_arena(a = next);
+	}
+      slab_free(bp);
+    }
+  if (a != NULL)
+    unlock_arena();
+}
+
+/*
+ * tcache_drain - move the objects other threads freed to tc into its bins,
+ *     flushing any bin that grows past its bounds, and leave remote set to
+ *     head (NULL, or TCACHE_CLOSED to turn later frees away).
+ */
+static void tcache_drain(tcache *tc, void *head)
+{
+  void *bp, *next;
+  size_t n = 0;
+  int cls;
+
+  bp = __atomic_exchange_n(&tc->remote, head, __ATOMIC_ACQUIRE);
+  if (bp == TCACHE_CLOSED)
+    bp = NULL;
+  for (; bp != NULL; bp = next, n++)
+    {
+      next = TCACHE_NEXT(bp);
+      cls = SLAB_RUN(bp)->cls;
+      tcache_push(tc, bp, cls);
+      if (tc->counts[cls] > TCACHE_BIN_MAX || tc->bytes > TCACHE_MAX_BYTES)
+	tcache_flush(tc, cls, TCACHE_BATCH);
+    }
+  __atomic_fetch_sub(&tc->remote_count, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * tcache_refill - fill tc's empty bin cls, first from its remote frees and
+ *     then with a batch from the slab runs. The bin stays empty if no
+ *     memory can be mapped.
+ */
+static void tcache_refill(tcache *tc, int cls)
+{
+  size_t room;
+  void *bp;
+  int n;
+
+  if (__atomic_load_n(&tc->remote, __ATOMIC_RELAXED) != NULL)
+    tcache_drain(tc, NULL);
+  if (tc->bins[cls] != NULL)
+    return;
+
+  //Start small so a class used only a few times pins few objects.
+  n = tc->batch[cls] == 0 ? 1 : tc->batch[cls];
+  tc->batch[cls] = n < TCACHE_BATCH ? 2 * n : TCACHE_BATCH;
+  room = (TCACHE_MAX_BYTES - tc->bytes) / SLAB_OBJ_SIZE(cls) + 1;
+  if (room < (size_t)n)
+    n = room;
+  lock_arena(thread_arena());
+  while (n-- > 0 && (bp = slab_malloc(SLAB_OBJ_SIZE(cls))) != NULL)
+    tcache_push(tc, bp, cls);
+  unlock_arena();
+}
+
+/*
+ * tcache_exit - hand an exiting thread's cached and remotely freed objects
+ *     back to the heap and free its slot for the next thread. Closing the
+ *     remote queue makes a free that raced past the alive check fall back
+ *     to the arena rather than strand its object on a dead slot.
+ */
+static void tcache_exit(void *arg)
+{
+  tcache *tc = arg;
+  int cls;
+
+  tcache_drain(tc, TCACHE_CLOSED);
+  for (cls = 0; cls < NUM_SLAB_CLASSES; cls++)
+    tcache_flush(tc, cls, tc->counts[cls]);
+  __atomic_store_n(&tc->alive, 0, __ATOMIC_RELEASE);
+  my_tcache = NULL;
+}
+
+/*
+ * tcache_attach - give the calling thread a cache slot, reusing one whose
+ *     thread has exited; NULL once all MAX_TCACHES are taken.
+ */
+static tcache *tcache_attach(void)
+{
+  tcache *tc = NULL;
+  int i;
+
+  spin_lock(&tcache_lock);
+  if (!tcache_key_made)
+    {
+      pthread_key_create(&tcache_key, tcache_exit);
+      tcache_key_made = 1;
+    }
+  for (i = 0; i < num_tcaches && tc == NULL; i++)
+    if (!tcaches[i].alive)
+      tc = &tcaches[i];
+  if (tc == NULL && num_tcaches < MAX_TCACHES)
+    {
+      tc = &tcaches[num_tcaches];
+      tc->id = num_tcaches;
+      __atomic_store_n(&num_tcaches, num_tcaches + 1, __ATOMIC_RELEASE);
+    }
+  if (tc != NULL)
+    {
+      //Nothing is queued on a closed slot, so it reopens empty.
+      __atomic_store_n(&tc->remote, NULL, __ATOMIC_RELAXED);
+      __atomic_store_n(&tc->alive, 1, __ATOMIC_RELEASE);
+      my_tcache = tc;
+      pthread_setspecific(tcache_key, tc);
+    }
+  spin_unlock(&tcache_lock);
+  return tc;
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * mm_malloc, mm_free, mm_realloc - the heap_ routines under an arena lock,
+ *     so that any number of threads can share the heap. New blocks come from
+ *     the calling thread's arena and old ones go back to the arena that owns
+ *     them. Slab-sized requests are served from the calling thread's cache
+ *     without any lock.
  */
+void *mm_malloc(size_t size)
+{
+  tcache *tc = my_tcache;
+  void *p;
+  int cls;
+
+  if (size - 1 < SLAB_MAX_SIZE && (tc != NULL || (tc = tcache_attach()) != NULL))
+    {
+      cls = SLAB_CLASS(size);
+      if (tc->bins[cls] == NULL)
+	tcache_refill(tc, cls);
+      return tc->bins[cls] != NULL ? tcache_pop(tc, cls) : NULL;
+    }
+
+  lock_arena(thread_arena());
+  p = heap_malloc(size);
+  unlock_arena();
+  return p;
+}
+
 void mm_free(void *ptr)
 {
-  GET_ALLOC(HDRP(ptr)) = 0;
-  GET_ALLOC(FTRP(ptr)) = 0;
-  coalesce(ptr);
-  attempt_unmap(ptr);
+  tcache *tc = my_tcache, *owner;
+  void *head;
+  int cls;
+
+  //A live slab object's run cannot go away, so its header is safe to read.
+  if (tc != NULL && is_slab_object(ptr))
+    {
+      cls = SLAB_RUN(ptr)->cls;
+      if (SLAB_RUN(ptr)->owner == tc->id)
+	{
+	  tcache_push(tc, ptr, cls);
+	  if (tc->counts[cls] > TCACHE_BIN_MAX || tc->bytes > TCACHE_MAX_BYTES)
+	    tcache_flush(tc, cls, TCACHE_BATCH);
+	  return;
+	}
+      if (SLAB_RUN(ptr)->owner < __atomic_load_n(&num_tcaches, __ATOMIC_ACQUIRE))
+	{
+	  owner = &tcaches[SLAB_RUN(ptr)->owner];
+	  //An owner that exits after this check has closed remote by the CAS.
+	  //A full queue is left alone: the object goes straight to its arena.
+	  if (__atomic_load_n(&owner->alive, __ATOMIC_ACQUIRE))
+	    {
+	      if (__atomic_fetch_add(&owner->remote_count, 1, __ATOMIC_RELAXED) < TCACHE_REMOTE_MAX)
+		{
+		  head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+		  while (head != TCACHE_CLOSED)
+		    {
+		      TCACHE_NEXT(ptr) = head;
+		      TCACHE_CHECK(ptr) = TCACHE_SEAL(ptr);
+		      if (__atomic_compare_exchange_n(&owner->remote, &head, ptr, 1,
+						      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		    }
+		}
+	      __atomic_fetch_sub(&owner->remote_count, 1, __ATOMIC_RELAXED);
+	    }
+	}
+    }
+
+  lock_arena(block_arena(ptr));
+  heap_free(ptr);
+  unlock_arena();
+}
+
+void *mm_realloc(void *ptr, size_t size)
+{
+  void *p;
+
+  lock_arena(ptr != NULL ? block_arena(ptr) : thread_arena());
+  p = heap_realloc(ptr, size);
+  unlock_arena();
+  return p;
+}
+
+/*
+ * mm_usable_size - the bytes of payload the allocated block ptr can hold,
+ *     at least as many as were asked for. Reads ptr's header like mm_free.
+ */
+size_t mm_usable_size(void *ptr)
+{
+  if (is_slab_object(ptr))
+    return SLAB_OBJ_SIZE(SLAB_RUN(ptr)->cls);
+  if (IS_LARGE(ptr))
+    return LARGE_PAYLOAD_SIZE(ptr);
+  return GET_SIZE(HDRP(ptr)) - WSIZE;
+}
+
+/*
+ * mm_fork_prepare, mm_fork_parent, mm_fork_child - hold every lock across
+ *     fork, so that the child never inherits one held by a thread it does
+ *     not have. The caches of those threads stay taken in the child.
+ */
+void mm_fork_prepare(void)
+{
+  spin_lock(&tcache_lock);
+  for (int i = 0; i < NUM_ARENAS; i++)
+    spin_lock(&arenas[i].lock);
+}
+
+void mm_fork_parent(void)
+{
+  for (int i = NUM_ARENAS - 1; i >= 0; i--)
+    spin_unlock(&arenas[i].lock);
+  spin_unlock(&tcache_lock);
+}
+
+void mm_fork_child(void)
+{
+  mm_fork_parent();
+}
+
+/*
+ * mm_reused_chunks - how many retained chunks extend has handed back out
+ *     since mm_init; each one saved a mem_map and a mem_unmap.
+ */
+size_t mm_reused_chunks(void)
+{
+  size_t n = 0;
+
+  for (int i = 0; i < NUM_ARENAS; i++)
+    n += arenas[i].chunks_reused;
+  return n;
 }
 
 int ptr_is_mapped(void *p, size_t len) 
@@ -397,63 +1485,333 @@ int ptr_is_mapped(void *p, size_t len)
 }
 
 /*
- * mm_check - Check whether the heap is ok, so that mm_malloc()
- *            and proper mm_free() calls won't crash.
+ * slab_run_is_valid - the run header of a run on list head of class cls is
+ *     intact and its free count matches its bitmap.
  */
-int mm_check()
+static int slab_run_is_valid(slab_run *run, slab_run *prev, int cls)
+{
+  int i, count = 0;
+  uint64_t check = 0;
+
+  if(((size_t)run & (mem_pagesize()-1)) != 0) { return 0; }
+  if(!ptr_is_mapped(run, mem_pagesize())) { return 0; }
+  if(run->magic != (SLAB_MAGIC ^ (size_t)run)) { return 0; }
+  if(run->prev != prev) { return 0; }
+  if(run->cls != cls) { return 0; }
+  if(run->arena != heap->id) { return 0; }
+  if(run->nobjs != SLAB_NOBJS(cls)) { return 0; }
+  if(run->nfree > run->nobjs) { return 0; }
+
+  for(i = 0; i < SLAB_BITMAP_WORDS; i++)
+    {
+      count += __builtin_popcountll(run->bitmap[i]);
+      check ^= run->bitmap[i];
+    }
+  if(count != run->nfree) { return 0; }
+  if(check != run->bitmap_check) { return 0; }
+
+  //No free bits past the last object.
+  if(run->nobjs < SLAB_BITMAP_WORDS * 64
+     && (run->bitmap[run->nobjs / 64] >> (run->nobjs % 64)) != 0) { return 0; }
+  for(i = run->nobjs / 64 + 1; i < SLAB_BITMAP_WORDS; i++)
+    if(run->bitmap[i] != 0) { return 0; }
+
+  return 1;
+}
+
+/*
+ * tcache_obj_is_valid - bp is a sealed object of class cls (any class if cls
+ *     is negative) that its run counts as in use.
+ */
+static int tcache_obj_is_valid(void *bp, int cls)
+{
+  slab_run *run = SLAB_RUN(bp);
+  size_t off, idx;
+
+  if(((size_t)bp & 15) != 0) { return 0; }
+  if(!ptr_is_mapped(run, mem_pagesize()) || !is_slab_object(bp)) { return 0; }
+  if(run->cls >= NUM_SLAB_CLASSES || (cls >= 0 && run->cls != cls)) { return 0; }
+  if(run->nobjs != SLAB_NOBJS(run->cls)) { return 0; }
+  if((char *)bp < SLAB_FIRST_OBJ(run)) { return 0; }
+  off = (char *)bp - SLAB_FIRST_OBJ(run);
+  if(off % SLAB_OBJ_SIZE(run->cls) != 0) { return 0; }
+  idx = off / SLAB_OBJ_SIZE(run->cls);
+  if(idx >= run->nobjs) { return 0; }
+  if(run->bitmap[idx / 64] & ((uint64_t)1 << (idx % 64))) { return 0; }
+  if(TCACHE_CHECK(bp) != TCACHE_SEAL(bp)) { return 0; }
+  return 1;
+}
+
+/*
+ * tcache_list_is_valid - the cache list at head holds exactly count valid
+ *     objects of class cls; sets *found if p is one of them.
+ */
+static int tcache_list_is_valid(void *head, size_t count, int cls, void *p, int *found)
+{
+  void *bp;
+
+  for(bp = head; bp != NULL; bp = TCACHE_NEXT(bp))
+    {
+      if(count-- == 0) { return 0; }
+      if(!tcache_obj_is_valid(bp, cls)) { return 0; }
+      if(bp == p) { *found = 1; }
+    }
+  return count == 0;
+}
+
+/*
+ * tcache_holds - whether some thread cache holds p, or 1 if a cache is
+ *     damaged, since then p might be in it.
+ */
+static int tcache_holds(void *p)
+{
+  int i, c, found = 0;
+
+  for(i = 0; i < num_tcaches; i++)
+    {
+      for(c = 0; c < NUM_SLAB_CLASSES; c++)
+	if(!tcache_list_is_valid(tcaches[i].bins[c], tcaches[i].counts[c], c, p, &found)) { return 1; }
+      if(!tcache_list_is_valid(TCACHE_REMOTE(&tcaches[i]), tcaches[i].remote_count, -1, p, &found)) { return 1; }
+    }
+  return found;
+}
+
+/*
+ * large_is_valid - the header and page struct of the large block bp agree
+ *     and the whole region is mapped.
+ */
+static int large_is_valid(void *bp)
+{
+  void *region = BLOCK_PAGE(bp);
+
+  if((GET(HDRP(bp)) & FLAG_BITS) != (LARGE_BIT | ALLOC_BIT)) { return 0; }
+  if(GET_SIZE(HDRP(bp)) != PAGE_SIZE(region)) { return 0; }
+  if(PAGE_SIZE(region) < PAGE_ALIGN(LARGE_THRESHOLD + PGSIZE + ALIGNMENT)) { return 0; }
+  if(PAGE_SIZE(region) > (size_t)MAX_BLOCK_SIZE) { return 0; }
+  if((PAGE_SIZE(region) & (mem_pagesize()-1)) != 0) { return 0; }
+  if(!ptr_is_mapped(region, PAGE_SIZE(region))) { return 0; }
+  return 1;
+}
+
+/*
+ * tree_is_valid - Check the free tree below h: every node is a free block
+ *     the tree should hold, in order after *prev, with no red link leaning
+ *     right or following another and the same number of black links on
+ *     every path. Returns that number, or -1. listed counts the nodes.
+ */
+static int tree_is_valid(tree_node *h, void **prev, size_t *listed, size_t free_count)
+{
+  int left, right;
+
+  if(h == NULL) { return 0; }
+  if(++*listed > free_count) { return -1; }
+  if(((size_t)h & 15) != 0) { return -1; }
+  if(!ptr_is_mapped(HDRP(h), WSIZE + sizeof(tree_node))) { return -1; }
+  if(GET_ALLOC(HDRP(h)) != 0 || !IN_TREE(GET_SIZE(HDRP(h)))) { return -1; }
+  if(GET_SIZE(HDRP(h)) > (size_t)MAX_BLOCK_SIZE || h->red > 1) { return -1; }
+
+  if((left = tree_is_valid(h->left, prev, listed, free_count)) < 0) { return -1; }
+  if(*prev != NULL && !tree_less(*prev, GET_SIZE(HDRP(*prev)), h)) { return -1; }
+  *prev = h;
+  if((right = tree_is_valid(h->right, prev, listed, free_count)) < 0) { return -1; }
+
+  if(llrb_is_red(h->right) || (h->red && llrb_is_red(h->left))) { return -1; }
+  if(left != right) { return -1; }
+  return left + !h->red;
+}
+
+/*
+ * arena_is_valid - Check whether the arena in heap is ok.
+ */
+static int arena_is_valid(void)
 {
   int d = 0;
-  void* pg = first_page;
+  int c;
+  size_t prev_alloc;
+  size_t free_count = 0, listed = 0;
+  void* pg = heap->first_page;
   void* pp;
+  void* fp;
+  void* prev_fp;
+  void* prev_pg = NULL;
   while(pg != NULL)
     {
       //Page is mapped.
       if(!ptr_is_mapped(pg,mem_pagesize())) { if(d)printf("16\n");return 0; }
+      if(((size_t)pg & (mem_pagesize()-1)) != 0) { if(d)printf("25\n");return 0; }
+      if(PREV_PAGE(pg) != prev_pg) { if(d)printf("26\n");return 0; }
       if(!ptr_is_mapped(pg,PAGE_SIZE(pg))) { if(d)printf("1\n");return 0; }
 
-      pp = (void *)pg + PGSIZE + BHSIZE;
-
-      //check for prologue blocks
-      if(GET_SIZE(HDRP(pp)) != OVERHEAD || GET_ALLOC(HDRP(pp)) != 1) { if(d)printf("2\n");return 0; }
-      if(GET_SIZE(FTRP(pp)) != OVERHEAD) { if(d)printf("15\n");return 0; }
+      //The first block starts right after the page struct.
+      pp = FIRST_BLKP(pg);
+      if(!(GET(HDRP(pp)) & FIRST_BIT) || !GET_PREV_ALLOC(HDRP(pp))) { if(d)printf("2\n");return 0; }
 
-      //Skip past prologue to check rest of the block.
-      pp = NEXT_BLKP(pp);
+      prev_alloc = PREV_ALLOC_BIT;
       while(GET_SIZE(HDRP(pp)) != 0)
 	{
 	  //Header is mapped
-	  if(!ptr_is_mapped(pp - BHSIZE, BHSIZE)) { if(d)printf("3\n");return 0;}
+	  if(!ptr_is_mapped(HDRP(pp), WSIZE)) { if(d)printf("3\n");return 0;}
 	  
 	  //Payload not 16 byte aligned
 	  if( ((size_t)pp & 15) != 0 ) { if(d)printf("4\n");return 0; }
 	  
-	  // Bidirectional check.
-	  if( !ptr_is_mapped(HDRP(pp),  GET_SIZE(HDRP(pp))) ) { if(d)printf("5\n");return 0; }
+	  //Size is sane and the block, plus the next header, is mapped.
 	  if( GET_SIZE(HDRP(pp)) > (size_t)MAX_BLOCK_SIZE) { if(d)printf("6\n");return 0;}
-	  if( GET_SIZE(HDRP(pp)) < 3 * BHSIZE) { if(d)printf("7\n");return 0; }
+	  if( GET_SIZE(HDRP(pp)) < MIN_BLOCK_SIZE) { if(d)printf("7\n");return 0; }
+	  if( !ptr_is_mapped(HDRP(pp), GET_SIZE(HDRP(pp)) + WSIZE) ) { if(d)printf("5\n");return 0; }
 
-	  if( ((size_t)FTRP(pp) & 15) != 0 ) { if(d)printf("8\n");return 0; }
-	  if( !ptr_is_mapped(HDRP(pp) ,GET_SIZE(FTRP(pp))) ) { if(d)printf("9\n");return 0; }
-	  if( GET_SIZE(FTRP(pp)) > (size_t)MAX_BLOCK_SIZE ) { if(d)printf("10\n");return 0; }
-	  if( GET_SIZE(FTRP(pp)) < 3 * BHSIZE) { if(d)printf("11\n");return 0; }
-      
-	  //Allocation bit is not 0 or 1
-	  if( GET_ALLOC(HDRP(pp)) != 0 && GET_ALLOC(HDRP(pp)) != 1) { if(d)printf("12\n");return 0; }
+	  //Only the first block of a chunk carries FIRST_BIT, and no chunk block is large.
+	  if( (GET(HDRP(pp)) & LARGE_BIT) != 0 ) { if(d)printf("12\n");return 0; }
+	  if( (GET(HDRP(pp)) & FIRST_BIT) != 0 && pp != FIRST_BLKP(pg) ) { if(d)printf("8\n");return 0; }
 
-	  //Check double check method for alloc to ensure that not both alloc bits were mangled.
-	  if(GET_ALLOC(HDRP(pp)) == 1 && GET_ALLOC(FTRP(pp)) == 0) { return 0; }
-	  if(GET_ALLOC(HDRP(pp)) == 0 && GET_ALLOC(FTRP(pp)) == 1) { return 0; }
+	  //Previous-allocated bit agrees with the block before, which doubles as
+	  //the check that an allocated header's bit was not mangled.
+	  if( GET_PREV_ALLOC(HDRP(pp)) != prev_alloc ) { if(d)printf("9\n");return 0; }
 
-	  //Header size is not the same as footer size.
-	  if( GET_SIZE(HDRP(pp)) != GET_SIZE(FTRP(pp)) ) { if(d)printf("13\n");return 0; }
+	  //Allocated blocks name this arena; free ones carry no arena bits.
+	  if( GET_ALLOC(HDRP(pp)) ? GET_ARENA(HDRP(pp)) != (size_t)heap->id : (GET(HDRP(pp)) & ARENA_BITS) != 0 ) { if(d)printf("45\n");return 0; }
 
-	  //No two consectuive blocks are free
-	  if( GET_ALLOC(HDRP(PREV_BLKP(pp))) == 0 && GET_ALLOC(HDRP(pp)) == 0 ) { if(d)printf("14\n");return 0; }
-	  
+	  if( GET_ALLOC(HDRP(pp)) == 0 )
+	    {
+	      //Footer matches header.
+	      if( GET(FTRP(pp)) != PACK(GET_SIZE(HDRP(pp)), 0) ) { if(d)printf("13\n");return 0; }
+
+	      //No two consectuive blocks are free
+	      if( !prev_alloc ) { if(d)printf("14\n");return 0; }
+
+	      free_count++;
+	    }
+
+	  prev_alloc = GET_ALLOC(HDRP(pp)) ? PREV_ALLOC_BIT : 0;
 	  pp = NEXT_BLKP(pp);
 	}
+	if( GET(HDRP(pp)) != PACK(0, ALLOC_BIT | prev_alloc) ) { if(d)printf("15\n");return 0; }
+	//Terminator sits at the end of the chunk.
+	if((void *)HDRP(pp) != (void *)pg + PAGE_SIZE(pg) - WSIZE) { if(d)printf("28\n");return 0; }
+	prev_pg = pg;
 	pg = NEXT_PAGE(pg);
     }
+  if(prev_pg != heap->last_page) { if(d)printf("27\n");return 0; }
+
+  //Every free block is on the list for its size class exactly once.
+  for(c = 0; c < NUM_CLASSES; c++)
+    {
+      prev_fp = NULL;
+      for(fp = heap->free_lists[c]; fp != NULL; fp = NEXT_FREE(fp))
+	{
+	  //More list entries than free blocks means a cycle or a stray block.
+	  if(++listed > free_count) { if(d)printf("17\n");return 0; }
+	  if( ((size_t)fp & 15) != 0 ) { if(d)printf("18\n");return 0; }
+	  if(!ptr_is_mapped(HDRP(fp), WSIZE + sizeof(free_node))) { if(d)printf("19\n");return 0; }
+	  if( GET_ALLOC(HDRP(fp)) != 0 ) { if(d)printf("20\n");return 0; }
+	  if( GET_SIZE(HDRP(fp)) < MIN_BLOCK_SIZE || GET_SIZE(HDRP(fp)) > (size_t)MAX_BLOCK_SIZE) { if(d)printf("21\n");return 0; }
+	  if( size_class(GET_SIZE(HDRP(fp))) != c ) { if(d)printf("22\n");return 0; }
+	  if( IN_TREE(GET_SIZE(HDRP(fp))) ) { if(d)printf("47\n");return 0; }
+	  if( PREV_FREE(fp) != prev_fp ) { if(d)printf("23\n");return 0; }
+	  prev_fp = fp;
+	}
+    }
+  //The rest are in the tree, in order and balanced.
+  prev_fp = NULL;
+  if(llrb_is_red(heap->free_tree) || tree_is_valid(heap->free_tree, &prev_fp, &listed, free_count) < 0) { if(d)printf("48\n");return 0; }
+  if(listed != free_count) { if(d)printf("24\n");return 0; }
+
+  //Slab runs: partial runs have a free object, full runs have none.
+  for(c = 0; c < NUM_SLAB_CLASSES; c++)
+    {
+      slab_run *run, *prev_run = NULL;
+      int empty = 0;
+      for(run = heap->slab_partial[c]; run != NULL; run = run->next)
+	{
+	  if(!slab_run_is_valid(run, prev_run, c) || run->nfree == 0) { if(d)printf("33\n");return 0; }
+	  empty += run->nfree == run->nobjs;
+	  prev_run = run;
+	}
+      if(empty != heap->slab_empty[c]) { if(d)printf("50\n");return 0; }
+      prev_run = NULL;
+      for(run = heap->slab_full[c]; run != NULL; run = run->next)
+	{
+	  if(!slab_run_is_valid(run, prev_run, c) || run->nfree != 0) { if(d)printf("34\n");return 0; }
+	  prev_run = run;
+	}
+    }
+  //Spare runs are whole runs of the class they last had.
+  {
+    slab_run *run, *prev_run = NULL;
+    int spares = 0;
+    for(run = heap->slab_spare; run != NULL; run = run->next)
+      {
+	if(++spares > SLAB_KEEP_SPARE || run->cls >= NUM_SLAB_CLASSES) { if(d)printf("51\n");return 0; }
+	if(!slab_run_is_valid(run, prev_run, run->cls) || run->nfree != run->nobjs) { if(d)printf("51\n");return 0; }
+	prev_run = run;
+      }
+    if(spares != heap->slab_spares) { if(d)printf("51\n");return 0; }
+  }
+
+  //Retained chunks: only their page structs are still in use.
+  prev_pg = NULL;
+  listed = 0;
+  for(pg = heap->retained; pg != NULL; pg = NEXT_PAGE(pg))
+    {
+      if(((size_t)pg & (mem_pagesize()-1)) != 0) { if(d)printf("35\n");return 0; }
+      if(!ptr_is_mapped(pg,mem_pagesize())) { if(d)printf("36\n");return 0; }
+      if(PREV_PAGE(pg) != prev_pg) { if(d)printf("37\n");return 0; }
+      if(PAGE_STAMP(pg) > heap->free_calls) { if(d)printf("38\n");return 0; }
+      if((PAGE_SIZE(pg) & (mem_pagesize()-1)) != 0 || PAGE_SIZE(pg) > heap->retained_bytes) { if(d)printf("39\n");return 0; }
+      if(!ptr_is_mapped(pg,PAGE_SIZE(pg))) { if(d)printf("40\n");return 0; }
+      listed += PAGE_SIZE(pg);
+      prev_pg = pg;
+    }
+  if(listed != heap->retained_bytes) { if(d)printf("41\n");return 0; }
+
+  //Directly mapped large blocks.
+  prev_pg = NULL;
+  for(pg = heap->first_large; pg != NULL; pg = NEXT_PAGE(pg))
+    {
+      if(((size_t)pg & (mem_pagesize()-1)) != 0) { if(d)printf("29\n");return 0; }
+      if(!ptr_is_mapped(pg,mem_pagesize())) { if(d)printf("30\n");return 0; }
+      if(PREV_PAGE(pg) != prev_pg) { if(d)printf("31\n");return 0; }
+      if(!large_is_valid(FIRST_BLKP(pg))) { if(d)printf("32\n");return 0; }
+      if(GET_ARENA(HDRP(FIRST_BLKP(pg))) != (size_t)heap->id) { if(d)printf("46\n");return 0; }
+      prev_pg = pg;
+    }
+
+  return 1;
+}
+
+/*
+ * mm_check - Check whether the heap is ok, so that mm_malloc()
+ *            and proper mm_free() calls won't crash.
+ */
+int mm_check()
+{
+  int d = 0;
+  int c;
+  arena *saved = heap;
+  size_t retained = 0;
+
+  for(c = 0; c < NUM_ARENAS; c++)
+    {
+      heap = &arenas[c];
+      if(arenas[c].id != c || !arena_is_valid()) { heap = saved; return 0; }
+      retained += arenas[c].retained_bytes;
+    }
+  heap = saved;
+  if(retained != retained_total || retained > RETAIN_BUDGET) { if(d)printf("49\n");return 0; }
+
+  //Thread caches: every list is sealed and as long as its count says.
+  for(c = 0; c < num_tcaches; c++)
+    {
+      int k, found = 0;
+      size_t bytes = 0;
+      for(k = 0; k < NUM_SLAB_CLASSES; k++)
+	{
+	  if(!tcache_list_is_valid(tcaches[c].bins[k], tcaches[c].counts[k], k, NULL, &found)) { if(d)printf("42\n");return 0; }
+	  bytes += tcaches[c].counts[k] * SLAB_OBJ_SIZE(k);
+	}
+      if(bytes != tcaches[c].bytes || bytes > TCACHE_MAX_BYTES) { if(d)printf("43\n");return 0; }
+      if(!tcache_list_is_valid(TCACHE_REMOTE(&tcaches[c]), tcaches[c].remote_count, -1, NULL, &found)) { if(d)printf("44\n");return 0; }
+    }
 
   return 1;
 }
@@ -467,32 +1825,54 @@ int mm_can_free(void *p)
   //p is 16 byte aligned
   if( ((size_t)p & 15) != 0 ) { return 0; }
 
-  //Header is not mapped
-  if(!ptr_is_mapped(HDRP(p), BHSIZE)) { return 0;}
+  //A slab object must sit on an object boundary of its run and be in use.
+  if(ptr_is_mapped(SLAB_RUN(p), sizeof(slab_run)) && is_slab_object(p))
+  {
+    slab_run *run = SLAB_RUN(p);
+    size_t off, idx;
+    if(run->cls >= NUM_SLAB_CLASSES) { return 0; }
+    if(run->arena >= NUM_ARENAS) { return 0; }
+    if((char *)p < SLAB_FIRST_OBJ(run)) { return 0; }
+    off = (char *)p - SLAB_FIRST_OBJ(run);
+    if(off % SLAB_OBJ_SIZE(run->cls) != 0) { return 0; }
+    idx = off / SLAB_OBJ_SIZE(run->cls);
+    if(idx >= run->nobjs || run->nobjs > SLAB_BITMAP_WORDS * 64) { return 0; }
+    if(run->bitmap[idx / 64] & ((uint64_t)1 << (idx % 64))) { return 0; }
+
+    //In use by its run but sitting in a thread cache is freed too.
+    return !tcache_holds(p);
+  }
 
-  // Bidirectional check.
-  if( !ptr_is_mapped(HDRP(p), GET_SIZE(HDRP(p))) ) { return 0; }
-  if( GET_SIZE(HDRP(p)) > (size_t)MAX_BLOCK_SIZE) { return 0; }
-  if( GET_SIZE(HDRP(p)) < 3 * BHSIZE) { return 0; }
+  //Header is not mapped
+  if(!ptr_is_mapped(HDRP(p), WSIZE)) { return 0;}
 
-  if( !ptr_is_mapped(HDRP(p), GET_SIZE(FTRP(p))) ) { return 0; }
-  if( GET_SIZE(FTRP(p)) > (size_t)MAX_BLOCK_SIZE ) { return 0; }
-  if( GET_SIZE(FTRP(p)) < 3 * BHSIZE) { return 0; }
-  
-  //is not prologue or epilogue
-  if(GET_SIZE(HDRP(p)) == OVERHEAD && GET_ALLOC(HDRP(p)) == 1) { return 0; }
-  if(GET_SIZE(FTRP(p)) == OVERHEAD && GET_ALLOC(HDRP(p)) == 1) { return 0; }
+  //The block must name a real arena.
+  if(GET_ARENA(HDRP(p)) >= NUM_ARENAS) { return 0; }
+  heap = &arenas[GET_ARENA(HDRP(p))];
 
-  //is not a terminator
-  if(GET_SIZE(HDRP(p)) == 0 && GET_ALLOC(HDRP(p)) == 1) { return 0; }
+  if(IS_LARGE(p))
+  {
+    void *region = BLOCK_PAGE(p);
+    if(((size_t)region & (mem_pagesize()-1)) != 0) { return 0; }
+    if(!large_is_valid(p)) { return 0; }
+
+    //Must still be linked into the large block list.
+    if(PREV_PAGE(region) == NULL)
+      return heap->first_large == region;
+    if(!ptr_is_mapped(PREV_PAGE(region), PGSIZE)) { return 0; }
+    return NEXT_PAGE(PREV_PAGE(region)) == region;
+  }
 
   // ensure that block was allocated.
   if( GET_ALLOC(HDRP(p)) != 1 ) { return 0; }
 
-  //Double Aloc bit check
-  if(GET_ALLOC(HDRP(p)) == 1 && GET_ALLOC(FTRP(p)) == 0) { return 0; }
-  if(GET_ALLOC(HDRP(p)) == 0 && GET_ALLOC(FTRP(p)) == 1) { return 0; }
+  // Size is sane and the block plus the next header is mapped.
+  if( GET_SIZE(HDRP(p)) > (size_t)MAX_BLOCK_SIZE) { return 0; }
+  if( GET_SIZE(HDRP(p)) < MIN_BLOCK_SIZE) { return 0; }
+  if( !ptr_is_mapped(HDRP(p), GET_SIZE(HDRP(p)) + WSIZE) ) { return 0; }
 
+  //Double Aloc bit check: the next block must agree that this one is allocated.
+  if( !GET_PREV_ALLOC(HDRP(NEXT_BLKP(p))) ) { return 0; }
 
   return 1;
 }
@@ -3,6 +3,13 @@
 extern int mm_init(void);
 extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
+extern void *mm_realloc(void *ptr, size_t size);
 
 extern int mm_check(void);
+extern size_t mm_reused_chunks(void);
 extern int mm_can_free(void *ptr);
+
+extern size_t mm_usable_size(void *ptr);
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
@@ -0,0 +1,364 @@
+/*
+ * mmpreload.c - mm.c as the malloc of any dynamically linked program
+ *
+ *     make libmm.so
+ *     LD_PRELOAD=./libmm.so program ...
+ *
+ * Exports malloc, free, calloc, realloc, reallocarray, posix_memalign,
+ * aligned_alloc, memalign, valloc, pvalloc and malloc_usable_size on top
+ * of mm_malloc, mm_free and mm_realloc. The heap is set up by whichever
+ * thread allocates first; memlib keeps no extents or page map, which
+ * would need a malloc of their own. MM_HUGEPAGES in the environment
+ * turns on memlib's huge page mode, as mdriver -H does.
+ *
+ * mm_malloc aligns to 16 bytes. A block with a larger alignment is cut
+ * from a bigger one, and its aligned address is remembered in a small
+ * table so that free and realloc can find the block it came from.
+ * Everything else in the library is hidden, so mm.c's globals cannot
+ * clash with the program's.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* Larger requests fail with ENOMEM before mm.c's size arithmetic can
+   overflow; smaller ones fail with ENOMEM when mem_map does */
+#define MAX_REQUEST ((size_t)1 << 47)
+
+/* mm_malloc's alignment */
+#define MM_ALIGNMENT 16
+
+/*
+ * The blocks handed out at an address past the start of their mm_malloc
+ * block, for alignments above MM_ALIGNMENT: an open addressing table from
+ * the aligned address to the block, under a spin lock. free only looks
+ * when the table is not empty.
+ */
+typedef struct {
+  void *aligned;       /* NULL if the slot is empty */
+  void *block;
+} aligned_slot;
+
+static aligned_slot *aligned_table;
+static size_t aligned_cap, aligned_count;
+static int aligned_lock;
+
+static void lock_aligned(void)
+{
+  while (__atomic_exchange_n(&aligned_lock, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&aligned_lock, __ATOMIC_RELAXED))
+      sched_yield();
+}
+
+static void unlock_aligned(void)
+{
+  __atomic_store_n(&aligned_lock, 0, __ATOMIC_RELEASE);
+}
+
+static size_t aligned_slot_of(void *p)
+{
+  size_t i = (((uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ULL >> 16) & (aligned_cap - 1);
+
+  while (aligned_table[i].aligned != NULL && aligned_table[i].aligned != p)
+    i = (i + 1) & (aligned_cap - 1);
+  return i;
+}
+
+/* aligned_add - remember that p was cut from block; 0 if out of memory */
+static int aligned_add(void *p, void *block)
+{
+  aligned_slot *old;
+  size_t i, old_cap;
+
+  lock_aligned();
+  if (2 * (aligned_count + 1) > aligned_cap) {
+    old = aligned_table;
+    old_cap = aligned_cap;
+    aligned_cap = aligned_cap ? 2 * aligned_cap : 64;
+    if ((aligned_table = mm_malloc(aligned_cap * sizeof(aligned_slot))) == NULL) {
+      aligned_table = old;
+      aligned_cap = old_cap;
+      unlock_aligned();
+      return 0;
+    }
+    memset(aligned_table, 0, aligned_cap * sizeof(aligned_slot));
+    for (i = 0; i < old_cap; i++)
+      if (old[i].aligned != NULL)
+        aligned_table[aligned_slot_of(old[i].aligned)] = old[i];
+    if (old != NULL)
+      mm_free(old);
+  }
+  i = aligned_slot_of(p);
+  aligned_table[i].aligned = p;
+  aligned_table[i].block = block;
+  __atomic_store_n(&aligned_count, aligned_count + 1, __ATOMIC_RELAXED);
+  unlock_aligned();
+  return 1;
+}
+
+/*
+ * aligned_find - the block p was cut from, or NULL if p is a block of its
+ *     own; with take set, p is also forgotten
+ */
+static void *aligned_find(void *p, int take)
+{
+  size_t i, j, home;
+  void *block = NULL;
+
+  if (__atomic_load_n(&aligned_count, __ATOMIC_RELAXED) == 0)
+    return NULL;
+  lock_aligned();
+  if (aligned_cap > 0 && aligned_table[i = aligned_slot_of(p)].aligned == p) {
+    block = aligned_table[i].block;
+    if (take) {
+      /* Move the slots after it back over the gap */
+      for (j = (i + 1) & (aligned_cap - 1); aligned_table[j].aligned != NULL;
+           j = (j + 1) & (aligned_cap - 1)) {
+        home = (((uintptr_t)aligned_table[j].aligned >> 4) * 0x9e3779b97f4a7c15ULL >> 16)
+          & (aligned_cap - 1);
+        if (((j - home) & (aligned_cap - 1)) >= ((j - i) & (aligned_cap - 1))) {
+          aligned_table[i] = aligned_table[j];
+          i = j;
+        }
+      }
+      aligned_table[i].aligned = NULL;
+      __atomic_store_n(&aligned_count, aligned_count - 1, __ATOMIC_RELAXED);
+    }
+  }
+  unlock_aligned();
+  return block;
+}
+
+/*
+ * fork_prepare, fork_parent, fork_child - hold the aligned table's lock
+ *     as well as mm.c's across fork; aligned_add takes mm.c's locks while
+ *     it holds this one, so this one comes first
+ */
+static void fork_prepare(void)
+{
+  lock_aligned();
+  mm_fork_prepare();
+}
+
+static void fork_parent(void)
+{
+  mm_fork_parent();
+  unlock_aligned();
+}
+
+static void fork_child(void)
+{
+  mm_fork_child();
+  unlock_aligned();
+}
+
+enum { UNINITIALIZED, INITIALIZING, READY };
+static int state = UNINITIALIZED;
+
+/*
+ * start - set up memlib and the heap once, however many threads call
+ *     first; the others wait until it is ready
+ */
+static void start(void)
+{
+  int expected = UNINITIALIZED;
+
+  if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == READY)
+    return;
+  if (__atomic_compare_exchange_n(&state, &expected, INITIALIZING, 0,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    mem_init();
+    mem_set_tracking(0);
+    mem_set_hugepages(getenv("MM_HUGEPAGES") != NULL);
+    mm_init();
+    __atomic_store_n(&state, READY, __ATOMIC_RELEASE);
+    /* May allocate, so only once the heap is ready */
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+    return;
+  }
+  while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != READY)
+    sched_yield();
+}
+
+static void *aligned_malloc(size_t align, size_t size)
+{
+  char *block, *p;
+
+  if (align <= MM_ALIGNMENT)
+    return malloc(size);
+  if (size > MAX_REQUEST || align > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  start();
+  if ((block = mm_malloc((size ? size : 1) + align - MM_ALIGNMENT)) == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  p = (char *)(((uintptr_t)block + align - 1) & ~(uintptr_t)(align - 1));
+  if (p != block && !aligned_add(p, block)) {
+    mm_free(block);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return p;
+}
+
+/*************************************
+ * The exported allocator
+ *************************************/
+
+EXPORT void *malloc(size_t size)
+{
+  void *p;
+
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  start();
+  if ((p = mm_malloc(size ? size : 1)) == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+EXPORT void free(void *p)
+{
+  void *block;
+
+  if (p == NULL)
+    return;
+  if ((block = aligned_find(p, 1)) != NULL)
+    p = block;
+  mm_free(p);
+}
+
+/*
+ * calloc - through mm_malloc, not malloc: gcc turns malloc and memset
+ *     into a call to calloc
+ */
+EXPORT void *calloc(size_t n, size_t size)
+{
+  size_t bytes;
+  void *p;
+
+  if (__builtin_mul_overflow(n, size, &bytes) || bytes > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  start();
+  if ((p = mm_malloc(bytes ? bytes : 1)) == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(p, 0, bytes);
+  return p;
+}
+
+EXPORT size_t malloc_usable_size(void *p)
+{
+  void *block;
+
+  if (p == NULL)
+    return 0;
+  if ((block = aligned_find(p, 0)) != NULL)
+    return mm_usable_size(block) - ((char *)p - (char *)block);
+  return mm_usable_size(p);
+}
+
+/*
+ * realloc - as mm_realloc, which frees p when size is 0; a block cut for
+ *     alignment moves to a plain one
+ */
+EXPORT void *realloc(void *p, size_t size)
+{
+  void *q;
+  size_t old;
+
+  if (p == NULL)
+    return malloc(size);
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (aligned_find(p, 0) != NULL) {
+    if (size == 0) {
+      free(p);
+      return NULL;
+    }
+    if ((q = malloc(size)) == NULL)
+      return NULL;
+    old = malloc_usable_size(p);
+    memcpy(q, p, old < size ? old : size);
+    free(p);
+    return q;
+  }
+  if ((q = mm_realloc(p, size)) == NULL && size != 0)
+    errno = ENOMEM;
+  return q;
+}
+
+EXPORT void *reallocarray(void *p, size_t n, size_t size)
+{
+  size_t bytes;
+
+  if (__builtin_mul_overflow(n, size, &bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(p, bytes);
+}
+
+EXPORT int posix_memalign(void **res, size_t align, size_t size)
+{
+  void *p;
+  int saved = errno;
+
+  if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+    return EINVAL;
+  p = aligned_malloc(align, size);
+  if (p == NULL) {
+    errno = saved;
+    return ENOMEM;
+  }
+  *res = p;
+  return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+  if (align == 0 || (align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned_malloc(align, size);
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+  return aligned_alloc(align, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+  return aligned_malloc(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+  size_t page = mem_pagesize();
+
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_malloc(page, (size + page - 1) & ~(page - 1));
+}
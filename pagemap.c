@@ -4,100 +4,178 @@
 #include "pagemap.h"
 
 /* Keep track of all mapped pages so that we can easily get a list of
-   all of them --- but also efficiently add and remove from the list. */
+   all of them --- but also efficiently add and remove from them, from
+   any number of threads at once and without a lock.
 
-typedef struct mpage {
-  void *addr;
-  struct mpage *prev, *next;
-} mpage;
+   A page's state is one bit in a small leaf that covers 2MB of address
+   space; leaves hang off a radix tree of 16KB nodes, so the page map
+   only grows with the address ranges actually in use. Nodes and leaves
+   are installed with a compare-and-swap; a thread that loses the race
+   frees its copy and uses the winner's. Bits are set and cleared with
+   atomic or/and, whose old value tells a double map or unmap apart.
+   Every leaf is also pushed on a list that only ever grows, so
+   pagemap_for_each finds the mapped pages by walking the leaves. */
 
-static mpage *all_mapped_pages;
+#define PAGEMAP_LEAF_BITS 9   /* pages per leaf: 512 */
+#define PAGEMAP_NODE_BITS 11  /* entries per node: 2048 */
+#define PAGEMAP_LEVELS 4      /* nodes on the way to a leaf */
+#define PAGEMAP_NODE_SIZE (1 << PAGEMAP_NODE_BITS)
+#define PAGEMAP_LEAF_SHIFT (LOG_APAGE_SIZE + PAGEMAP_LEAF_BITS)
+#define PAGEMAP_NODE_INDEX(p, l) \
+  ((((uintptr_t)(p)) >> (PAGEMAP_LEAF_SHIFT + PAGEMAP_NODE_BITS * (PAGEMAP_LEVELS - 1 - (l)))) \
+   & (PAGEMAP_NODE_SIZE - 1))
+#define PAGEMAP_LEAF_INDEX(p) \
+  ((((uintptr_t)(p)) >> LOG_APAGE_SIZE) & ((1 << PAGEMAP_LEAF_BITS) - 1))
+#define PAGEMAP_BASE(p) (((uintptr_t)(p)) & ~(((uintptr_t)1 << PAGEMAP_LEAF_SHIFT) - 1))
 
-static mpage ***page_maps1;
+#define WORD_BITS 64
+#define LEAF_WORDS ((1 << PAGEMAP_LEAF_BITS) / WORD_BITS)
 
-#define PAGEMAP64_LEVEL1_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL2_SIZE (1 << 16)
-#define PAGEMAP64_LEVEL3_SIZE (1 << (32 - LOG_APAGE_SIZE))
-#define PAGEMAP64_LEVEL1_BITS(p) (((uintptr_t)(p)) >> 48)
-#define PAGEMAP64_LEVEL2_BITS(p) ((((uintptr_t)(p)) >> 32) & ((PAGEMAP64_LEVEL2_SIZE) - 1))
-#define PAGEMAP64_LEVEL3_BITS(p) ((((uintptr_t)(p)) >> LOG_APAGE_SIZE) & ((PAGEMAP64_LEVEL3_SIZE) - 1))
+typedef struct leaf {
+  uintptr_t base;            /* address of page 0 */
+  struct leaf *next;         /* on all_leaves */
+  uint64_t bits[LEAF_WORDS]; /* bit i: page i is mapped */
+} leaf;
 
-void pagemap_modify(void *p, int mapped) {
-  uintptr_t pos;
-  mpage **page_maps2;
-  mpage *page_maps3;
-  mpage *page;
+static void *root[PAGEMAP_NODE_SIZE];
+static leaf *all_leaves;
+static size_t map_bytes; /* nodes and leaves allocated so far */
 
-  if (!page_maps1) {
-    page_maps1 = calloc(PAGEMAP64_LEVEL1_SIZE, sizeof(mpage **));
+static void *zalloc(size_t sz) {
+  void *p = calloc(1, sz);
+  if (!p) {
+    fprintf(stderr, "internal error: out of memory for the page map\n");
+    abort();
   }
+  return p;
+}
+
+/* Install fresh in *slot unless another thread got there first; return
+   whichever is there. */
+static void *install(void **slot, void *fresh, size_t sz) {
+  void *cur = NULL;
 
-  pos = PAGEMAP64_LEVEL1_BITS(p);
-  page_maps2 = page_maps1[pos];
-  if (!page_maps2) {
-    page_maps2 = calloc(PAGEMAP64_LEVEL2_SIZE, sizeof(mpage *));
-    page_maps1[pos] = page_maps2;
+  if (__atomic_compare_exchange_n(slot, &cur, fresh, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_fetch_add(&map_bytes, sz, __ATOMIC_RELAXED);
+    return fresh;
   }
-  
-  pos = PAGEMAP64_LEVEL2_BITS(p);
-  page_maps3 = page_maps2[pos];
-  if (!page_maps3) {
-    page_maps3 = calloc(PAGEMAP64_LEVEL3_SIZE, sizeof(mpage));
-    page_maps2[pos] = page_maps3;
+  free(fresh);
+  return cur;
+}
+
+static leaf *get_leaf(void *p) {
+  void **node = root;
+  void *next;
+  leaf *l;
+  int i;
+
+  for (i = 0; i < PAGEMAP_LEVELS - 1; i++) {
+    next = __atomic_load_n(&node[PAGEMAP_NODE_INDEX(p, i)], __ATOMIC_ACQUIRE);
+    if (!next)
+      next = install(&node[PAGEMAP_NODE_INDEX(p, i)],
+                     zalloc(PAGEMAP_NODE_SIZE * sizeof(void *)),
+                     PAGEMAP_NODE_SIZE * sizeof(void *));
+    node = next;
   }
 
-  page = &page_maps3[PAGEMAP64_LEVEL3_BITS(p)];
+  l = __atomic_load_n(&node[PAGEMAP_NODE_INDEX(p, i)], __ATOMIC_ACQUIRE);
+  if (l)
+    return l;
+  l = zalloc(sizeof(leaf));
+  l->base = PAGEMAP_BASE(p);
+  if (install(&node[PAGEMAP_NODE_INDEX(p, i)], l, sizeof(leaf)) != l)
+    return node[PAGEMAP_NODE_INDEX(p, i)];
 
-  if (mapped) {
-    if (page->addr) {
-      fprintf(stderr, "internal error: page is already mapped\n");
-      abort();
-    }
-    if (page == all_mapped_pages)
-      abort();
-    page->addr = p;
-    page->prev = NULL;
-    page->next = all_mapped_pages;
-    if (all_mapped_pages)
-      all_mapped_pages->prev = page;
-    all_mapped_pages = page;
-  } else {
-    if (!page->addr) {
-      fprintf(stderr, "internal error: not currently mapped\n");
-      abort();
+  /* Only the thread that installed the leaf publishes it. */
+  l->next = __atomic_load_n(&all_leaves, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&all_leaves, &l->next, l, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return l;
+}
+
+/* Set or clear pages first .. first + n - 1 of leaf l, a word at a time. */
+static void modify_in_leaf(leaf *l, uintptr_t first, uintptr_t n, int mapped) {
+  uintptr_t i, k;
+  uint64_t mask, old;
+
+  for (i = first; i < first + n; i += k) {
+    k = WORD_BITS - i % WORD_BITS;
+    if (k > first + n - i)
+      k = first + n - i;
+    mask = (k == WORD_BITS ? ~(uint64_t)0 : (((uint64_t)1 << k) - 1)) << (i % WORD_BITS);
+    if (mapped) {
+      old = __atomic_fetch_or(&l->bits[i / WORD_BITS], mask, __ATOMIC_ACQ_REL);
+      if (old & mask) {
+        fprintf(stderr, "internal error: page is already mapped\n");
+        abort();
+      }
+    } else {
+      old = __atomic_fetch_and(&l->bits[i / WORD_BITS], ~mask, __ATOMIC_ACQ_REL);
+      if ((old & mask) != mask) {
+        fprintf(stderr, "internal error: not currently mapped\n");
+        abort();
+      }
     }
-    page->addr = NULL;
-    if (page->prev)
-      page->prev->next = page->next;
-    else
-      all_mapped_pages = page->next;
-    if (page->next)
-      page->next->prev = page->prev;
   }
 }
 
+void pagemap_modify_range(void *p, size_t len, int mapped) {
+  uintptr_t a = (uintptr_t)p, end = a + len, n;
+
+  while (a < end) {
+    n = (1 << PAGEMAP_LEAF_BITS) - PAGEMAP_LEAF_INDEX(a);
+    if (n > (end - a) >> LOG_APAGE_SIZE)
+      n = (end - a) >> LOG_APAGE_SIZE;
+    modify_in_leaf(get_leaf((void *)a), PAGEMAP_LEAF_INDEX(a), n, mapped);
+    a += n << LOG_APAGE_SIZE;
+  }
+}
+
+void pagemap_modify(void *p, int mapped) {
+  pagemap_modify_range(p, APAGE_SIZE, mapped);
+}
+
 int pagemap_is_mapped(void *p) {
-  mpage **page_maps2;
-  mpage *page_maps3;
-
-  if (!page_maps1) return 0;
-  page_maps2 = page_maps1[PAGEMAP64_LEVEL1_BITS(p)];
-  if (!page_maps2) return 0;
-  page_maps3 = page_maps2[PAGEMAP64_LEVEL2_BITS(p)];
-  if (!page_maps3) return 0;
-  return !!page_maps3[PAGEMAP64_LEVEL3_BITS(p)].addr;
+  void **node = root;
+  leaf *l;
+  uintptr_t i;
+  int lv;
+
+  for (lv = 0; lv < PAGEMAP_LEVELS - 1; lv++) {
+    node = __atomic_load_n(&node[PAGEMAP_NODE_INDEX(p, lv)], __ATOMIC_ACQUIRE);
+    if (!node) return 0;
+  }
+  l = __atomic_load_n(&node[PAGEMAP_NODE_INDEX(p, lv)], __ATOMIC_ACQUIRE);
+  if (!l) return 0;
+  i = PAGEMAP_LEAF_INDEX(p);
+  return !!(__atomic_load_n(&l->bits[i / WORD_BITS], __ATOMIC_ACQUIRE)
+            & ((uint64_t)1 << (i % WORD_BITS)));
 }
 
+/* Pages mapped or unmapped by other threads while this runs may or may
+   not be visited. */
 void pagemap_for_each(page_callback f, int do_unmap) {
-  mpage *p, *next;
-  p = all_mapped_pages;
-  while (p) {
-    next = p->next;
-    f(p->addr);
-    if (do_unmap)
-      pagemap_modify(p->addr, 0);
-    p = next;
+  leaf *l;
+  size_t w;
+  uint64_t bits;
+
+  for (l = __atomic_load_n(&all_leaves, __ATOMIC_ACQUIRE); l; l = l->next) {
+    for (w = 0; w < LEAF_WORDS; w++) {
+      bits = __atomic_load_n(&l->bits[w], __ATOMIC_ACQUIRE);
+      while (bits) {
+        void *addr = (void *)(l->base + ((w * WORD_BITS + __builtin_ctzll(bits))
+                                         << LOG_APAGE_SIZE));
+        bits &= bits - 1;
+        f(addr);
+        if (do_unmap)
+          pagemap_modify(addr, 0);
+      }
+    }
   }
-  if (do_unmap)
-    all_mapped_pages = NULL;
+}
+
+size_t pagemap_bytes(void) {
+  return sizeof(root) + __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
 }
@@ -1,10 +1,17 @@
+#include <stddef.h>
 
 typedef void (*page_callback)(void *addr);
 
 void pagemap_modify(void *addr, int mapped);
+void pagemap_modify_range(void *addr, size_t len, int mapped); /* whole pages */
 int pagemap_is_mapped(void *addr);
 void pagemap_for_each(page_callback f, int do_unmap);
+size_t pagemap_bytes(void); /* bytes of bookkeeping behind the map */
 
 /* APAGE_SIZE needs to match the actual page size */
 #define LOG_APAGE_SIZE 12
 #define APAGE_SIZE (1 << LOG_APAGE_SIZE)
+
+/* The transparent huge page size that huge page mode aligns to */
+#define LOG_HPAGE_SIZE 21
+#define HPAGE_SIZE (1 << LOG_HPAGE_SIZE)
@@ -0,0 +1,31 @@
+/*
+ * trace.h - The requests of a Malloc Lab trace, and the binary trace
+ *     format that mdriver maps and gentrace writes
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* 
+ * A binary trace file is this header followed directly by num_ops
+ * traceop_t records, in the byte order and layout of the machine that
+ * wrote it. Such files are mapped and their ops used in place.
+ */
+#define BINTRACE_MAGIC "mmtrace1"
+typedef struct {
+    char magic[8];       /* BINTRACE_MAGIC, without the terminating NUL */
+    int op_size;         /* sizeof(traceop_t) of the writer */
+    int sugg_heapsize;
+    int num_ids;
+    int num_ops;
+    int weight;
+    int unused;          /* keeps the ops 8-byte aligned */
+} bintrace_hdr_t;
+
+#endif
@@ -0,0 +1,543 @@
+/*
+ * gentrace.c - Generate synthetic Malloc Lab traces of any length
+ *
+ * Covers the patterns of the gen_*.pl scripts and a general random
+ * pattern with size and lifetime distributions and realloc chains.
+ * The trace is generated twice from the same seed: once to count the
+ * ops, ids and peak live bytes that go in the header, and once to
+ * stream it out, as text or in the binary format of ../trace.h. Ids
+ * are reused once freed and only live blocks are remembered, so the
+ * memory used grows with the blocks live at once, not with the number
+ * of ops. The traces are balanced: blocks still live at the end are
+ * freed in id order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+
+#include "trace.h"
+
+/* A distribution of block sizes or lifetimes, given as name:a:b */
+typedef struct {
+    enum {CONST, UNIFORM, EXP, POW2, PARETO, REST} kind;
+    double a, b;
+} dist_t;
+
+/* The next request due for a live block of the random pattern */
+typedef struct {
+    unsigned long long when;  /* allocation count at which it is due */
+    unsigned long long seq;   /* orders requests due at the same time */
+    unsigned long long death; /* allocation count at which it is freed */
+    int id;
+    int size;
+    int reallocs;             /* reallocs still to come before the free */
+} event_t;
+
+/* The state of one pass over the trace */
+typedef struct {
+    FILE *out;                /* NULL while counting */
+    int binary;               /* write the binary format */
+    unsigned long long rng;
+    long long num_ops;
+    int num_ids, ids_cap;     /* ids used, and room in size and free_ids */
+    long long live, peak;     /* payload bytes live now and at most */
+    int *size;                /* size of each live id, -1 if free */
+    int *free_ids;            /* stack of ids free for reuse */
+    int num_free;
+    event_t *heap;            /* pending requests, earliest first */
+    int heap_len, heap_cap;
+    unsigned long long seq;
+} gen_t;
+
+/* The pattern and its parameters, from the command line */
+static char *pattern = "random";
+static long long count = -1;           /* blocks or iterations */
+static dist_t size_dist = {UNIFORM, 1, 32767};
+static dist_t life_dist = {REST, 0, 0};
+static double chain_prob = 0;          /* chance a block is reallocated */
+static double chain_len = 1;           /* mean reallocs of those blocks */
+static int chain_grow = 64;            /* most bytes added by a realloc */
+static int params[3];                  /* pattern:a:b:c */
+
+/* Helper routines */
+static void *xrealloc(void *p, size_t len);
+static void usage(void);
+
+/*************************************
+ * Random numbers and distributions
+ *************************************/
+
+/* rand_u - a uniform double in [0, 1), from splitmix64 */
+static double rand_u(gen_t *g)
+{
+    unsigned long long z = (g->rng += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * parse_dist - Parse name:a[:b] into d, returning 0 if it is not a
+ *     distribution of this kind (rest is only a lifetime)
+ */
+static int parse_dist(char *s, dist_t *d, int lifetime)
+{
+    char name[16];
+    int n;
+
+    d->a = d->b = 0;
+    n = sscanf(s, "%15[a-z2]:%lf:%lf", name, &d->a, &d->b);
+    if (n == 2 && strcmp(name, "const") == 0)
+	d->kind = CONST;
+    else if (n == 3 && strcmp(name, "uniform") == 0 && d->a <= d->b)
+	d->kind = UNIFORM;
+    else if (n == 2 && strcmp(name, "exp") == 0 && d->a > 0)
+	d->kind = EXP;
+    else if (n == 3 && strcmp(name, "pow2") == 0 && d->a >= 1 && d->a <= d->b)
+	d->kind = POW2;
+    else if (n == 3 && strcmp(name, "pareto") == 0 && d->a > 0 && d->b > 0)
+	d->kind = PARETO;
+    else if (n == 1 && strcmp(name, "rest") == 0 && lifetime)
+	d->kind = REST;
+    else
+	return 0;
+    return 1;
+}
+
+/* sample - draw from d; rest is uniform over the allocations left */
+static double sample(gen_t *g, dist_t *d, long long left)
+{
+    double u = rand_u(g);
+    int lo, hi;
+
+    switch (d->kind) {
+    case CONST:
+	return d->a;
+    case UNIFORM:
+	return d->a + floor(u * (d->b - d->a + 1));
+    case EXP:
+	return floor(-d->a * log(1 - u));
+    case POW2:
+	lo = (int)floor(log2(d->a));
+	hi = (int)floor(log2(d->b));
+	return ldexp(1, lo + (int)floor(u * (hi - lo + 1)));
+    case PARETO:
+	return floor(d->a / pow(1 - u, 1 / d->b));
+    case REST:
+	return 1 + floor(u * left);
+    }
+    return 0;
+}
+
+/* clamp - d as an int in [lo, INT_MAX] */
+static int clamp(double d, int lo)
+{
+    if (d < lo)
+	return lo;
+    return d > INT_MAX ? INT_MAX : (int)d;
+}
+
+/*************************************
+ * Emitting requests
+ *************************************/
+
+static void emit(gen_t *g, int type, int id, int size)
+{
+    static const char tag[] = {'a', 'f', 'r'};
+    traceop_t op;
+
+    g->num_ops++;
+    if (g->out == NULL)
+	return;
+    if (g->binary) {
+	op.type = type;
+	op.index = id;
+	op.size = size;
+	fwrite(&op, sizeof(op), 1, g->out);
+    }
+    else if (type == FREE)
+	fprintf(g->out, "f %d\n", id);
+    else
+	fprintf(g->out, "%c %d %d\n", tag[type], id, size);
+}
+
+static void set_live(gen_t *g, int id, int size)
+{
+    g->live += size - (g->size[id] < 0 ? 0 : g->size[id]);
+    if (g->live > g->peak)
+	g->peak = g->live;
+    g->size[id] = size;
+}
+
+/* gen_alloc - allocate size bytes under the most recently freed id */
+static int gen_alloc(gen_t *g, int size)
+{
+    int id;
+
+    if (g->num_free > 0)
+	id = g->free_ids[--g->num_free];
+    else {
+	if (g->num_ids == g->ids_cap) {
+	    g->ids_cap = g->ids_cap ? 2 * g->ids_cap : 256;
+	    g->size = xrealloc(g->size, g->ids_cap * sizeof(int));
+	    g->free_ids = xrealloc(g->free_ids, g->ids_cap * sizeof(int));
+	}
+	id = g->num_ids++;
+	g->size[id] = -1;
+    }
+    set_live(g, id, size);
+    emit(g, ALLOC, id, size);
+    return id;
+}
+
+static void gen_realloc(gen_t *g, int id, int size)
+{
+    set_live(g, id, size);
+    emit(g, REALLOC, id, size);
+}
+
+static void gen_free(gen_t *g, int id)
+{
+    g->live -= g->size[id];
+    g->size[id] = -1;
+    g->free_ids[g->num_free++] = id;
+    emit(g, FREE, id, 0);
+}
+
+/*************************************
+ * The pending requests of the random pattern
+ *************************************/
+
+static int event_before(event_t *a, event_t *b)
+{
+    return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void push_event(gen_t *g, event_t *e)
+{
+    int i, parent;
+
+    if (g->heap_len == g->heap_cap) {
+	g->heap_cap = g->heap_cap ? 2 * g->heap_cap : 1024;
+	g->heap = xrealloc(g->heap, g->heap_cap * sizeof(event_t));
+    }
+    e->seq = g->seq++;
+    for (i = g->heap_len++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (!event_before(e, &g->heap[parent]))
+	    break;
+	g->heap[i] = g->heap[parent];
+    }
+    g->heap[i] = *e;
+}
+
+static event_t pop_event(gen_t *g)
+{
+    event_t top = g->heap[0], last = g->heap[--g->heap_len];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < g->heap_len) {
+	if (child + 1 < g->heap_len && event_before(&g->heap[child + 1], &g->heap[child]))
+	    child++;
+	if (!event_before(&g->heap[child], &last))
+	    break;
+	g->heap[i] = g->heap[child];
+	i = child;
+    }
+    g->heap[i] = last;
+    return top;
+}
+
+/*
+ * schedule - queue e's next request: its reallocs are spread evenly
+ *     over its lifetime from now, then it is freed
+ */
+static void schedule(gen_t *g, event_t *e, unsigned long long now)
+{
+    e->when = now + (e->death - now) / (e->reallocs + 1);
+    push_event(g, e);
+}
+
+/* do_event - issue a pending request */
+static void do_event(gen_t *g, event_t *e, unsigned long long now)
+{
+    if (e->reallocs > 0) {
+	e->reallocs--;
+	e->size = clamp(e->size + 1 + floor(rand_u(g) * chain_grow), 0);
+	gen_realloc(g, e->id, e->size);
+	schedule(g, e, now);
+    }
+    else
+	gen_free(g, e->id);
+}
+
+/*************************************
+ * The patterns
+ *************************************/
+
+/*
+ * gen_random - count blocks of sizes from size_dist, each freed after
+ *     a lifetime from life_dist, counted in allocations. A block is a
+ *     realloc chain with probability chain_prob, growing by 1 to
+ *     chain_grow bytes chain_len times on average before it is freed.
+ */
+static void gen_random(gen_t *g)
+{
+    unsigned long long t;
+    event_t e, next;
+
+    for (t = 0; t < (unsigned long long)count; t++) {
+	while (g->heap_len > 0 && g->heap[0].when <= t) {
+	    next = pop_event(g);
+	    do_event(g, &next, t);
+	}
+	e.size = clamp(sample(g, &size_dist, 0), 1);
+	e.id = gen_alloc(g, e.size);
+	e.death = t + clamp(sample(g, &life_dist, count - t), 1);
+	e.reallocs = 0;
+	if (chain_prob > 0 && rand_u(g) < chain_prob)
+	    e.reallocs = chain_len > 1 ?
+		1 + clamp(log(1 - rand_u(g)) / log(1 - 1 / chain_len), 0) : 1;
+	schedule(g, &e, t);
+    }
+    while (g->heap_len > 0) {
+	next = pop_event(g);
+	do_event(g, &next, next.when);
+    }
+}
+
+/*
+ * gen_binary - (gen_binary.pl) count pairs of a small and a large
+ *     block, free the large ones, then allocate count blocks of both
+ *     sizes together
+ */
+static void gen_binary(gen_t *g)
+{
+    long long i;
+
+    for (i = 0; i < count; i++) {
+	gen_alloc(g, params[0]);
+	gen_alloc(g, params[1]);
+    }
+    for (i = 0; i < count; i++)
+	gen_free(g, 2 * i + 1);
+    for (i = 0; i < count; i++)
+	gen_alloc(g, params[0] + params[1]);
+}
+
+/*
+ * gen_coalescing - (gen_coalescing.pl) allocate and free two blocks of
+ *     a size, then one block twice that size, count times
+ */
+static void gen_coalescing(gen_t *g)
+{
+    long long i;
+    int extra, b1, b2;
+
+    extra = gen_alloc(g, 2 * params[0]);
+    for (i = 0; i < count; i++) {
+	b1 = gen_alloc(g, params[0]);
+	b2 = gen_alloc(g, params[0]);
+	gen_free(g, b1);
+	gen_free(g, b2);
+	gen_free(g, gen_alloc(g, 2 * params[0]));
+    }
+    gen_free(g, extra);
+}
+
+/*
+ * gen_realloc2 - (gen_realloc2.pl) grow one block count times by a
+ *     step, each time allocating a small block and freeing the one
+ *     before it
+ */
+static void gen_realloc2(gen_t *g)
+{
+    long long i;
+    int grow, prev, small;
+    int size = params[0];
+
+    grow = gen_alloc(g, size);
+    prev = gen_alloc(g, params[2]);
+    for (i = 1; i < count; i++) {
+	size = clamp((double)size + params[1], 1);
+	gen_realloc(g, grow, size);
+	small = gen_alloc(g, params[2]);
+	gen_free(g, prev);
+	prev = small;
+    }
+    gen_free(g, prev);
+    gen_free(g, grow);
+}
+
+/* The patterns, their default counts and parameters */
+static struct {
+    char *name;
+    void (*gen)(gen_t *g);
+    long long count;
+    int params[3];
+} patterns[] = {
+    { "random",     gen_random,     2400, {0, 0, 0} },
+    { "binary",     gen_binary,     2000, {64, 448, 0} },
+    { "coalescing", gen_coalescing, 2400, {4095, 0, 0} },
+    { "realloc",    gen_realloc2,   4800, {4092, 5, 16} },
+    { NULL,         NULL,           0,    {0, 0, 0} }
+};
+
+/*
+ * run - One pass over the trace: generate it, then free what is left
+ */
+static void run(gen_t *g, void (*gen)(gen_t *g), unsigned long long seed)
+{
+    int id;
+
+    g->rng = seed;
+    gen(g);
+    for (id = 0; id < g->num_ids; id++)
+	if (g->size[id] >= 0)
+	    gen_free(g, id);
+}
+
+static void reset(gen_t *g)
+{
+    free(g->size);
+    free(g->free_ids);
+    free(g->heap);
+    memset(g, 0, sizeof(*g));
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, n, binary = 0;
+    unsigned long long seed = 1;
+    char *outfile = NULL, name[32];
+    gen_t g;
+    bintrace_hdr_t hdr;
+    FILE *out = stdout;
+    int sugg_heapsize;
+
+    while ((c = getopt(argc, argv, "bs:n:z:l:r:o:h")) != EOF) {
+	switch (c) {
+	case 'b': /* Write the binary format */
+	    binary = 1;
+	    break;
+	case 's': /* Seed */
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'n': /* Blocks or iterations */
+	    count = atoll(optarg);
+	    if (count < 1)
+		usage();
+	    break;
+	case 'z': /* Size distribution */
+	    if (!parse_dist(optarg, &size_dist, 0))
+		usage();
+	    break;
+	case 'l': /* Lifetime distribution */
+	    if (!parse_dist(optarg, &life_dist, 1))
+		usage();
+	    break;
+	case 'r': /* Realloc chains */
+	    n = sscanf(optarg, "%lf:%lf:%d", &chain_prob, &chain_len, &chain_grow);
+	    if (n < 1 || chain_prob < 0 || chain_prob > 1 || chain_len < 1 || chain_grow < 0)
+		usage();
+	    break;
+	case 'o': /* Output file */
+	    outfile = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind < argc)
+	pattern = argv[optind++];
+    if (optind < argc)
+	usage();
+
+    /* pattern[:a[:b[:c]]] */
+    n = sscanf(pattern, "%31[a-z0-9]:%d:%d:%d", name, &params[0], &params[1], &params[2]);
+    for (i = 0; patterns[i].name && strcmp(patterns[i].name, name) != 0; i++)
+	;
+    if (n < 1 || patterns[i].name == NULL)
+	usage();
+    if (n < 4)
+	memcpy(params + n - 1, patterns[i].params + n - 1, (4 - n) * sizeof(int));
+    if (count < 0)
+	count = patterns[i].count;
+
+    /* Count the header values */
+    memset(&g, 0, sizeof(g));
+    run(&g, patterns[i].gen, seed);
+    if (g.num_ops > INT_MAX) {
+	fprintf(stderr, "gentrace: %lld ops is more than a trace can hold\n", g.num_ops);
+	exit(1);
+    }
+    sugg_heapsize = clamp((double)g.peak + 100, 0);
+
+    if (outfile && (out = fopen(outfile, "w")) == NULL) {
+	perror(outfile);
+	exit(1);
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    if (binary) {
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+	hdr.op_size = sizeof(traceop_t);
+	hdr.sugg_heapsize = sugg_heapsize;
+	hdr.num_ids = g.num_ids;
+	hdr.num_ops = g.num_ops;
+	hdr.weight = 1;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+    }
+    else
+	fprintf(out, "%d\n%d\n%lld\n1\n", sugg_heapsize, g.num_ids, g.num_ops);
+
+    /* Write the trace */
+    reset(&g);
+    g.out = out;
+    g.binary = binary;
+    run(&g, patterns[i].gen, seed);
+    if (fflush(out) != 0 || ferror(out) || (out != stdout && fclose(out) != 0)) {
+	perror(outfile ? outfile : "stdout");
+	exit(1);
+    }
+    reset(&g);
+    exit(0);
+}
+
+static void *xrealloc(void *p, size_t len)
+{
+    if ((p = realloc(p, len)) == NULL) {
+	fprintf(stderr, "gentrace: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-b] [-s <seed>] [-n <count>] [-z <dist>] [-l <dist>]\n"
+	    "                [-r <prob>[:<len>[:<grow>]]] [-o <file>] [<pattern>]\n");
+    fprintf(stderr, "Patterns\n");
+    fprintf(stderr, "\trandom             <count> blocks with -z sizes and -l lifetimes (default)\n");
+    fprintf(stderr, "\tbinary[:s:l]       small and large blocks, as gen_binary.pl\n");
+    fprintf(stderr, "\tcoalescing[:s]     as gen_coalescing.pl\n");
+    fprintf(stderr, "\trealloc[:s:d:m]    grow one block by d, as gen_realloc2.pl\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write the binary trace format.\n");
+    fprintf(stderr, "\t-s <seed>  Seed the random numbers.\n");
+    fprintf(stderr, "\t-n <count> Blocks (random) or iterations (others).\n");
+    fprintf(stderr, "\t-z <dist>  Sizes in bytes, at least 1 (default uniform:1:32767).\n");
+    fprintf(stderr, "\t-l <dist>  Lifetimes in allocations (default rest).\n");
+    fprintf(stderr, "\t-r ...     Make blocks realloc chains with probability <prob>,\n");
+    fprintf(stderr, "\t           <len> reallocs on average, each adding 1 to <grow> bytes.\n");
+    fprintf(stderr, "\t-o <file>  Write to <file> instead of stdout.\n");
+    fprintf(stderr, "Distributions\n");
+    fprintf(stderr, "\tconst:a, uniform:a:b, exp:mean, pow2:a:b, pareto:min:alpha,\n");
+    fprintf(stderr, "\tand for lifetimes rest: uniform over the allocations left.\n");
+    exit(1);
+}
@@ -0,0 +1,617 @@
+/*
+ * mmcapture.c - Record the malloc traffic of a program as a trace
+ *
+ * Build it as a shared library (make mmcapture.so) and preload it:
+ *
+ *     MM_CAPTURE=app.bin LD_PRELOAD=./mmcapture.so app ...
+ *
+ * It interposes malloc, calloc, realloc, free and the aligned
+ * allocators, passes them on to glibc's own malloc, and writes a
+ * balanced binary trace (see ../trace.h) that mdriver replays with
+ * -f app.bin. A %p in MM_CAPTURE stands for the pid, and without it
+ * the trace goes to mmcapture.%p.bin. A program that the traced one
+ * runs is traced too, unless its file is the one still being written.
+ *
+ * Each live pointer gets an id, which is reused once the pointer is
+ * freed, so num_ids grows with the blocks live at once. Pointers are
+ * found in a hash table split into stripes, each behind its own spin
+ * lock. Every request takes the next number of one atomic counter, is
+ * buffered by its thread and later written at that position of a
+ * mapping of the trace file, so the trace keeps the order in which
+ * the requests happened. At exit the blocks still live are freed in
+ * id order and the header is filled in.
+ *
+ * mdriver's allocators take no alignment and fail on 0 bytes, so the
+ * aligned allocators are recorded as plain allocations and a request
+ * for 0 bytes as one for 1. Pointers allocated before the library was
+ * initialized, and requests made in a child after fork, are not
+ * recorded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "trace.h"
+
+/* glibc's own allocator, which we pass every request on to */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+#define STRIPES      256      /* locks over the pointer table */
+#define BUF_OPS      4096     /* requests buffered by each thread */
+#define FILE_OPS     (1 << 20) /* ops the trace file starts out with room for */
+#define MAX_OPS      INT_MAX  /* num_ops is an int */
+
+/* A request and its position in the trace */
+typedef struct {
+    unsigned long long seq;
+    traceop_t op;
+} record_t;
+
+/* One thread's buffered requests, and the ids it has freed */
+typedef struct buffer {
+    struct buffer *next;      /* on all_buffers */
+    int in_use;               /* owned by a live thread */
+    int len;
+    record_t recs[BUF_OPS];
+    int *ids;                 /* stack of ids free for reuse */
+    int num_ids, max_ids;
+} buffer_t;
+
+/* A live pointer and its id */
+typedef struct {
+    void *p;                  /* NULL if the slot is empty */
+    int id;
+} slot_t;
+
+/* A stripe of the table from live pointers to their ids */
+typedef struct {
+    int lock;
+    size_t cap, count;        /* slots, and those in use */
+    slot_t *slots;            /* linear probing */
+} __attribute__((aligned(64))) stripe_t;
+
+static stripe_t table[STRIPES];
+static int capturing;                   /* recording requests */
+static int recorders;                   /* threads inside a recording */
+static unsigned long long next_seq;     /* position of the next request */
+static int next_id;                     /* id never used yet */
+static pthread_key_t buffer_key;        /* flushes a thread's buffer at exit */
+static int buffers_lock;                /* guards all_buffers */
+static buffer_t *all_buffers;
+
+/* The trace file, mapped with room for MAX_OPS ops */
+static int trace_fd = -1;
+static bintrace_hdr_t *trace_hdr;
+static traceop_t *trace_ops;
+static unsigned long long file_ops;     /* ops the file has room for */
+static int file_lock;                   /* guards growing it */
+
+static __thread buffer_t *my_buffer __attribute__((tls_model("initial-exec")));
+static __thread int in_capture __attribute__((tls_model("initial-exec")));
+
+/*
+ * spin_lock, spin_unlock - a test-and-test-and-set spin lock. A waiter
+ *     yields its CPU, since the holder may be preempted.
+ */
+static inline void spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+	while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+	    sched_yield();
+}
+
+static inline void spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*************************************
+ * The table from live pointers to ids
+ *************************************/
+
+static inline unsigned long long hash(void *p)
+{
+    return ((unsigned long long)(uintptr_t)p >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static stripe_t *stripe_of(void *p)
+{
+    return &table[hash(p) >> 56];
+}
+
+/* slot_of - the slot of p in s, or the empty slot where it would go */
+static size_t slot_of(stripe_t *s, void *p)
+{
+    size_t i = (hash(p) >> 16) & (s->cap - 1);
+
+    while (s->slots[i].p != NULL && s->slots[i].p != p)
+	i = (i + 1) & (s->cap - 1);
+    return i;
+}
+
+static void table_insert(void *p, int id)
+{
+    stripe_t *s = stripe_of(p);
+    size_t i, old_cap;
+    slot_t *old;
+
+    spin_lock(&s->lock);
+    if (2 * (s->count + 1) > s->cap) {
+	old = s->slots;
+	old_cap = s->cap;
+	s->cap = s->cap ? 2 * s->cap : 1024;
+	s->slots = __libc_calloc(s->cap, sizeof(s->slots[0]));
+	if (s->slots == NULL) {
+	    fprintf(stderr, "mmcapture: out of memory\n");
+	    abort();
+	}
+	for (i = 0; i < old_cap; i++)
+	    if (old[i].p != NULL)
+		s->slots[slot_of(s, old[i].p)] = old[i];
+	__libc_free(old);
+    }
+    i = slot_of(s, p);
+    s->slots[i].p = p;
+    s->slots[i].id = id;
+    s->count++;
+    spin_unlock(&s->lock);
+}
+
+/*
+ * table_remove - forget p and return its id, or -1 if p was not
+ *     recorded. The slots after it move back to close the gap.
+ */
+static int table_remove(void *p)
+{
+    stripe_t *s = stripe_of(p);
+    size_t i, j, home;
+    int id = -1;
+
+    spin_lock(&s->lock);
+    if (s->cap > 0 && s->slots[i = slot_of(s, p)].p == p) {
+	id = s->slots[i].id;
+	s->count--;
+	for (j = (i + 1) & (s->cap - 1); s->slots[j].p != NULL; j = (j + 1) & (s->cap - 1)) {
+	    home = (hash(s->slots[j].p) >> 16) & (s->cap - 1);
+	    if (((j - home) & (s->cap - 1)) >= ((j - i) & (s->cap - 1))) {
+		s->slots[i] = s->slots[j];
+		i = j;
+	    }
+	}
+	s->slots[i].p = NULL;
+    }
+    spin_unlock(&s->lock);
+    return id;
+}
+
+/*************************************
+ * Buffering and writing the requests
+ *************************************/
+
+/* grow_file - make room in the trace file for the op at seq */
+static void grow_file(unsigned long long seq)
+{
+    unsigned long long ops;
+
+    spin_lock(&file_lock);
+    ops = file_ops;
+    while (ops <= seq)
+	ops *= 2;
+    if (ops != file_ops) {
+	if (ops > MAX_OPS)
+	    ops = MAX_OPS;
+	if (seq >= ops || ftruncate(trace_fd, sizeof(bintrace_hdr_t) + ops * sizeof(traceop_t)) < 0) {
+	    fprintf(stderr, "mmcapture: cannot grow the trace to %llu ops\n", seq + 1);
+	    abort();
+	}
+	__atomic_store_n(&file_ops, ops, __ATOMIC_RELEASE);
+    }
+    spin_unlock(&file_lock);
+}
+
+/* flush - write b's requests to their places in the trace file */
+static void flush(buffer_t *b)
+{
+    int i;
+
+    for (i = 0; i < b->len; i++) {
+	if (b->recs[i].seq >= __atomic_load_n(&file_ops, __ATOMIC_ACQUIRE))
+	    grow_file(b->recs[i].seq);
+	trace_ops[b->recs[i].seq] = b->recs[i].op;
+    }
+    b->len = 0;
+}
+
+/*
+ * thread_exit - flush the buffer of an exiting thread and give it up,
+ *     unless the trace is already finished (or is the parent's)
+ */
+static void thread_exit(void *arg)
+{
+    buffer_t *b = arg;
+
+    spin_lock(&buffers_lock);
+    if (__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+	flush(b);
+    b->in_use = 0;
+    spin_unlock(&buffers_lock);
+}
+
+/* get_buffer - this thread's buffer, taking a free one or a new one */
+static buffer_t *get_buffer(void)
+{
+    buffer_t *b;
+
+    if (my_buffer != NULL)
+	return my_buffer;
+    spin_lock(&buffers_lock);
+    for (b = all_buffers; b != NULL && b->in_use; b = b->next)
+	;
+    if (b == NULL) {
+	if ((b = __libc_calloc(1, sizeof(buffer_t))) == NULL) {
+	    fprintf(stderr, "mmcapture: out of memory\n");
+	    abort();
+	}
+	b->next = all_buffers;
+	all_buffers = b;
+    }
+    b->in_use = 1;
+    spin_unlock(&buffers_lock);
+    my_buffer = b;
+    pthread_setspecific(buffer_key, b);
+    return b;
+}
+
+/* record - buffer a request, numbered in the order they happen */
+static void record(buffer_t *b, int type, int id, size_t size)
+{
+    record_t *r;
+
+    if (b->len == BUF_OPS) {
+	spin_lock(&buffers_lock);
+	flush(b);
+	spin_unlock(&buffers_lock);
+    }
+    r = &b->recs[b->len++];
+    r->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    r->op.type = type;
+    r->op.index = id;
+    r->op.size = size == 0 ? 1 : size > INT_MAX ? INT_MAX : (int)size;
+}
+
+/* new_id - an id for a new block: one this thread freed, or a new one */
+static int new_id(buffer_t *b)
+{
+    if (b->num_ids > 0)
+	return b->ids[--b->num_ids];
+    return __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+static void free_id(buffer_t *b, int id)
+{
+    if (b->num_ids == b->max_ids) {
+	b->max_ids = b->max_ids ? 2 * b->max_ids : 256;
+	if ((b->ids = __libc_realloc(b->ids, b->max_ids * sizeof(int))) == NULL) {
+	    fprintf(stderr, "mmcapture: out of memory\n");
+	    abort();
+	}
+    }
+    b->ids[b->num_ids++] = id;
+}
+
+/*
+ * The recording half of each request. A pointer leaves the table
+ * before glibc may hand it out again, and enters it only after glibc
+ * hands it out, so a pointer is never in the table twice.
+ */
+static inline int recording(void)
+{
+    return __atomic_load_n(&capturing, __ATOMIC_RELAXED) && !in_capture;
+}
+
+/*
+ * enter_capture, leave_capture - bracket the recording of a request.
+ *     A thread counts itself in recorders before it looks at capturing
+ *     again, so once capture_fini has cleared capturing and seen
+ *     recorders drop to 0, no thread can take a number or touch its
+ *     buffer. Returns 0, and records nothing, if capturing has stopped.
+ */
+static int enter_capture(void)
+{
+    __atomic_fetch_add(&recorders, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&capturing, __ATOMIC_SEQ_CST)) {
+	__atomic_fetch_sub(&recorders, 1, __ATOMIC_RELEASE);
+	return 0;
+    }
+    in_capture = 1;
+    return 1;
+}
+
+static void leave_capture(void)
+{
+    in_capture = 0;
+    __atomic_fetch_sub(&recorders, 1, __ATOMIC_RELEASE);
+}
+
+/* note_alloc - give the new block p an id and record its allocation */
+static void note_alloc(buffer_t *b, void *p, size_t size)
+{
+    int id = new_id(b);
+
+    table_insert(p, id);
+    record(b, ALLOC, id, size);
+}
+
+static void capture_alloc(void *p, size_t size)
+{
+    if (!enter_capture())
+	return;
+    note_alloc(get_buffer(), p, size);
+    leave_capture();
+}
+
+static void capture_free(void *p)
+{
+    buffer_t *b;
+    int id;
+
+    if (!enter_capture())
+	return;
+    if ((id = table_remove(p)) >= 0) {
+	b = get_buffer();
+	record(b, FREE, id, 0);
+	free_id(b, id);
+    }
+    leave_capture();
+}
+
+/*************************************
+ * The interposed allocator
+ *************************************/
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p != NULL && recording())
+	capture_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+
+    if (p != NULL && recording())
+	capture_alloc(p, n * size);
+    return p;
+}
+
+void free(void *p)
+{
+    if (p != NULL && recording())
+	capture_free(p);
+    __libc_free(p);
+}
+
+/*
+ * realloc - take p out of the table first, since glibc may free it;
+ *     put it back under the same id if it moves or stays. The whole
+ *     request is one recording, so capture_fini never sees p missing.
+ */
+void *realloc(void *p, size_t size)
+{
+    void *q;
+    buffer_t *b;
+    int id;
+
+    if (p == NULL || !recording())
+	return p == NULL ? malloc(size) : __libc_realloc(p, size);
+    if (!enter_capture())
+	return __libc_realloc(p, size);
+
+    id = table_remove(p);
+    q = __libc_realloc(p, size);
+    b = get_buffer();
+    if (id < 0) {                  /* not ours: a new block if anything */
+	if (q != NULL && q != p)
+	    note_alloc(b, q, size);
+    }
+    else if (q != NULL) {
+	table_insert(q, id);
+	record(b, REALLOC, id, size);
+    }
+    else if (size == 0) {          /* glibc freed p */
+	record(b, FREE, id, 0);
+	free_id(b, id);
+    }
+    else                           /* failed; p is still allocated */
+	table_insert(p, id);
+    leave_capture();
+    return q;
+}
+
+static void *aligned(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+
+    if (p != NULL && recording())
+	capture_alloc(p, size);
+    return p;
+}
+
+int posix_memalign(void **res, size_t align, size_t size)
+{
+    void *p;
+
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((p = aligned(align, size)) == NULL)
+	return ENOMEM;
+    *res = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return aligned(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned(align, size);
+}
+
+/*************************************
+ * Starting and finishing the trace
+ *************************************/
+
+/* A child after fork must not write into the parent's trace */
+static void stop_in_child(void)
+{
+    capturing = 0;
+}
+
+__attribute__((constructor))
+static void capture_init(void)
+{
+    char name[PATH_MAX], *fmt = getenv("MM_CAPTURE");
+    void *map;
+    size_t n = 0;
+
+    /* The file name, with %p replaced by our pid */
+    if (fmt == NULL)
+	fmt = "mmcapture.%p.bin";
+    for (; *fmt && n < sizeof(name) - 24; fmt++)
+	if (fmt[0] == '%' && fmt[1] == 'p') {
+	    n += sprintf(name + n, "%d", (int)getpid());
+	    fmt++;
+	}
+	else
+	    name[n++] = *fmt;
+    name[n] = 0;
+
+    /* A program we run may inherit MM_CAPTURE; it leaves our trace alone */
+    if ((trace_fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+	fprintf(stderr, "mmcapture: cannot create %s: %s\n", name, strerror(errno));
+	return;
+    }
+    if (flock(trace_fd, LOCK_EX | LOCK_NB) < 0 || ftruncate(trace_fd, 0) < 0) {
+	close(trace_fd);
+	return;
+    }
+    map = mmap(NULL, sizeof(bintrace_hdr_t) + (size_t)MAX_OPS * sizeof(traceop_t),
+	       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, trace_fd, 0);
+    if (map == MAP_FAILED) {
+	fprintf(stderr, "mmcapture: cannot map %s: %s\n", name, strerror(errno));
+	close(trace_fd);
+	return;
+    }
+    trace_hdr = map;
+    trace_ops = (traceop_t *)(trace_hdr + 1);
+    if (ftruncate(trace_fd, sizeof(bintrace_hdr_t) + FILE_OPS * sizeof(traceop_t)) < 0) {
+	fprintf(stderr, "mmcapture: cannot grow %s: %s\n", name, strerror(errno));
+	return;
+    }
+    file_ops = FILE_OPS;
+
+    pthread_key_create(&buffer_key, thread_exit);
+    pthread_atfork(NULL, NULL, stop_in_child);
+    __atomic_store_n(&capturing, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * capture_fini - Stop recording, wait for the threads still recording
+ *     a request, write out every buffer, free the blocks still live in
+ *     id order, and fill in the header. A trace with an op that was
+ *     never written is discarded rather than left with a hole in it.
+ */
+__attribute__((destructor))
+static void capture_fini(void)
+{
+    buffer_t *b;
+    unsigned char *live;
+    size_t *sizes, heap = 0, max_heap = 0;
+    unsigned long long i, num_ops;
+    int s, id;
+
+    if (!__atomic_exchange_n(&capturing, 0, __ATOMIC_SEQ_CST))
+	return;
+    in_capture = 1;
+    while (__atomic_load_n(&recorders, __ATOMIC_ACQUIRE) > 0)
+	sched_yield();
+
+    spin_lock(&buffers_lock);
+    for (b = all_buffers; b != NULL; b = b->next)
+	flush(b);
+    spin_unlock(&buffers_lock);
+
+    /* Requests never have 0 bytes, so a zero-filled op is a hole */
+    for (i = 0; i < next_seq; i++)
+	if (trace_ops[i].type == ALLOC && trace_ops[i].size == 0) {
+	    fprintf(stderr, "mmcapture: op %llu was never written; discarding the trace\n", i);
+	    munmap(trace_hdr, sizeof(bintrace_hdr_t) + (size_t)MAX_OPS * sizeof(traceop_t));
+	    if (ftruncate(trace_fd, 0) < 0)
+		fprintf(stderr, "mmcapture: cannot trim the trace: %s\n", strerror(errno));
+	    close(trace_fd);
+	    return;
+	}
+
+    /* Free the blocks still live */
+    live = __libc_calloc(next_id + 1, 1);
+    sizes = __libc_calloc(next_id + 1, sizeof(size_t));
+    if (live == NULL || sizes == NULL) {
+	fprintf(stderr, "mmcapture: out of memory\n");
+	abort();
+    }
+    for (s = 0; s < STRIPES; s++)
+	for (i = 0; i < table[s].cap; i++)
+	    if (table[s].slots[i].p != NULL)
+		live[table[s].slots[i].id] = 1;
+    num_ops = next_seq;
+    for (id = 0; id < next_id; id++)
+	if (live[id]) {
+	    if (num_ops >= file_ops)
+		grow_file(num_ops);
+	    trace_ops[num_ops].type = FREE;
+	    trace_ops[num_ops].index = id;
+	    trace_ops[num_ops].size = 0;
+	    num_ops++;
+	}
+
+    /* The most bytes live at once suggests a heap size */
+    for (i = 0; i < num_ops; i++) {
+	id = trace_ops[i].index;
+	heap -= sizes[id];
+	sizes[id] = trace_ops[i].type == FREE ? 0 : trace_ops[i].size;
+	heap += sizes[id];
+	if (heap > max_heap)
+	    max_heap = heap;
+    }
+    __libc_free(live);
+    __libc_free(sizes);
+
+    memcpy(trace_hdr->magic, BINTRACE_MAGIC, sizeof(trace_hdr->magic));
+    trace_hdr->op_size = sizeof(traceop_t);
+    trace_hdr->sugg_heapsize = max_heap > INT_MAX ? INT_MAX : (int)max_heap;
+    trace_hdr->num_ids = next_id;
+    trace_hdr->num_ops = num_ops;
+    trace_hdr->weight = 1;
+    munmap(trace_hdr, sizeof(bintrace_hdr_t) + (size_t)MAX_OPS * sizeof(traceop_t));
+    if (ftruncate(trace_fd, sizeof(bintrace_hdr_t) + num_ops * sizeof(traceop_t)) < 0)
+	fprintf(stderr, "mmcapture: cannot trim the trace: %s\n", strerror(errno));
+    close(trace_fd);
+}